@@ -10,6 +10,23 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/sysinfo.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 
 #define W 128
 #define H 128
@@ -17,6 +34,7 @@
 #define MAX_HP 1000
 
 #define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+#define BIT(x) (1u << (x))
 
 #ifdef DEBUG
     #define check(x)\
@@ -36,6 +54,10 @@
 
 typedef enum {
     PROGRAM_LIMIT = 500,
+    ROUND_LIMIT = 10000,
+    LABEL_LIMIT = 10,
+    // Instructions per turn for programs run unattended, see match.step_limit
+    STEP_LIMIT = 1000,
 } limits_enum;
 
 typedef enum {
@@ -78,6 +100,14 @@ typedef enum {
     FLAGS_COUNT,
 } flags_enum;
 
+const char *flags_enum_strings[] = {
+    "LT",
+    "GT",
+    "EQ",
+    "ER",
+    "FLAGS_COUNT",
+};
+
 typedef enum {
     R0 = 0,
     R1,
@@ -146,6 +176,10 @@ typedef enum {
     RET,
 
     OPS_COUNT,
+
+    // Sets the flags from a constant mask. Only produced by
+    // program_specialize, never parsed.
+    SETF,
 } ops_enum;
 
 const char *ops_enum_strings[] = {
@@ -173,37 +207,74 @@ const char *ops_enum_strings[] = {
     "RET",
 
     "OPS_COUNT",
+
+    "SETF",
 };
 
 
+// What program_analyze found out about a program, and the cheaper code
+// fightvm_run_program runs instead of the bytecode. Register and flag sets
+// are bitmasks over registers_enum and flags_enum.
+typedef struct program_spec {
+    int specialized;
+    int *code;
+    size_t code_len;
+    int labels[LABEL_LIMIT];
+
+    int instructions;
+    int reachable;
+    int loops;
+
+    unsigned int reads;
+    unsigned int writes;
+    unsigned int flag_reads;
+    unsigned int flag_writes;
+
+    // Registers and flags that may be read before they are written
+    unsigned int live_in;
+    unsigned int flags_live_in;
+
+    // Registers zeroed on entry, and whether T0 has to be kept current
+    unsigned int clear;
+    unsigned int load;
+    int ticks;
+} program_spec;
+
 typedef struct program {
-    int hp;
     const char *name;
     char *asmcode;
     size_t asmcode_len;
     int *bytecode;
     size_t bytecode_len;
-    int labels[10];
+    int labels[LABEL_LIMIT];
+    program_spec spec;
 
     program_result_enum result;
-    int strength;
 } program;
 
 #define PROGRAM_COUNT 2
 program user_program[PROGRAM_COUNT];
 
-int flags[FLAGS_COUNT];
-int registers[REGISTERS_COUNT];
+// Everything that changes while two programs fight. Programs themselves are
+// never written to during a match, so many matches can share them.
+typedef struct match {
+    program *fighter[PROGRAM_COUNT];
+    int hp[PROGRAM_COUNT];
+    int strength[PROGRAM_COUNT];
 
-typedef struct software_texture
-{
-    SDL_Surface *surface;
-    int w, h;
-    Uint32 *pixels;
-} software_texture;
+    int flags[FLAGS_COUNT];
+    int registers[REGISTERS_COUNT];
+
+    unsigned int seed;
+    int rounds;
+    int verbose;
+    // When not 0, a turn is cut off after this many instructions
+    int step_limit;
+} match;
+
+static match current_match;
 
-static software_texture cpu_texture;
-static SDL_Texture *gpu_texture;
+static SDL_Window *window;
 static SDL_Renderer *renderer;
 
 static int done()
@@ -224,9 +295,9 @@ static int done()
     return 0;
 }
 
-static int randrange (int lower, int upper)
+static int randrange (unsigned int *seed, int lower, int upper)
 {
-    return (rand() % (upper - lower + 1)) + lower;
+    return (rand_r(seed) % (upper - lower + 1)) + lower;
 }
 
 extern inline double dist(double x1, double y1, double x2, double y2)
@@ -252,7 +323,7 @@ int read_code(const char *path, program *user_program)
             if (len == 0) {
                 fputs("Error reading file", stderr);
             } else {
-                user_program->asmcode[++len] = '\0'; /* Just to be safe. */
+                user_program->asmcode[len++] = '\0'; /* Just to be safe. */
                 user_program->name = basename(path);
             }
             user_program->asmcode_len = len;
@@ -328,7 +399,527 @@ void program_set_bytecode(program *p, int code)
     p->bytecode[p->bytecode_len++] = code;
 }
 
-void parse_code(program *user_program)
+// Number of ints an instruction occupies in the bytecode, opcode included.
+int op_length(int op)
+{
+    switch (op) {
+        case STORE:
+        case MOVE:
+            return 3;
+        case INC:
+        case DEC:
+        case INCEQ:
+        case DECEQ:
+        case LABEL:
+        case JMP:
+        case JMPEQ:
+        case JMPNE:
+        case JMPGT:
+        case JMPLT:
+        case SETF:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Points every label at its LABEL instruction. Jumps to a label that is not
+// defined land on the last instruction and so end the program.
+static void link_labels(int *code, int len, int *labels)
+{
+    for (int i = 0; i < LABEL_LIMIT; i++) {
+        labels[i] = len - 1;
+    }
+    for (int ip = 0; ip < len; ip += op_length(code[ip])) {
+        if (code[ip] == LABEL) {
+            labels[code[ip + 1]] = ip + 1;
+        }
+    }
+}
+
+void program_link_labels(program *p)
+{
+    link_labels(p->bytecode, p->bytecode_len, p->labels);
+}
+
+// Specialized code is at most three ints per instruction
+#define SPEC_CAPACITY(len) (3 * (len) + 1)
+
+#define ALL_FLAGS (BIT(LT) | BIT(GT) | BIT(EQ) | BIT(ER))
+
+// Control flow graph over instructions. Successor n stands for leaving the
+// program.
+typedef struct program_graph {
+    int n;
+    int offset[PROGRAM_LIMIT + 1];
+    int index[SPEC_CAPACITY(PROGRAM_LIMIT)];
+    int succ[PROGRAM_LIMIT][2];
+    int succ_count[PROGRAM_LIMIT];
+    char color[PROGRAM_LIMIT];
+} program_graph;
+
+// What is known about register and flag values on entry to an instruction
+typedef struct const_state {
+    int seen;
+    unsigned int known;
+    int value[REGISTERS_COUNT];
+    int flags_known;
+    unsigned int flags;
+} const_state;
+
+static void instruction_effects(int *ins, unsigned int *use, unsigned int *def,
+        unsigned int *flag_use, unsigned int *flag_def)
+{
+    *use = *def = *flag_use = *flag_def = 0;
+    switch (ins[0]) {
+        case STORE:
+            *def = BIT(ins[1]);
+            break;
+        case MOVE:
+            *use = BIT(ins[2]);
+            *def = BIT(ins[1]);
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+            *use = BIT(I0) | BIT(I1);
+            *def = BIT(O0);
+            break;
+        case INC:
+        case DEC:
+            *use = *def = BIT(ins[1]);
+            break;
+        case INCEQ:
+        case DECEQ:
+            *use = *def = BIT(ins[1]);
+            *flag_use = BIT(EQ);
+            break;
+        case CMP:
+            *use = BIT(I0) | BIT(I1);
+            *flag_def = ALL_FLAGS;
+            break;
+        case SETF:
+            *flag_def = ALL_FLAGS;
+            break;
+        case JMPEQ:
+        case JMPNE:
+            *flag_use = BIT(EQ);
+            break;
+        case JMPGT:
+            *flag_use = BIT(GT);
+            break;
+        case JMPLT:
+            *flag_use = BIT(LT);
+            break;
+    }
+}
+
+static int graph_target(program_graph *g, int len, int *labels, int label)
+{
+    int ip = labels[label] + 1;
+    return ip >= len ? g->n : g->index[ip];
+}
+
+static void graph_build(program_graph *g, int *code, int len, int *labels)
+{
+    int i, ip;
+
+    g->n = 0;
+    for (ip = 0; ip < len; ip += op_length(code[ip])) {
+        g->index[ip] = g->n;
+        g->offset[g->n++] = ip;
+    }
+    g->offset[g->n] = len;
+
+    for (i = 0; i < g->n; i++) {
+        int *ins = &code[g->offset[i]];
+        g->succ_count[i] = 1;
+        g->succ[i][0] = i + 1;
+        switch (ins[0]) {
+            case RET:
+                g->succ[i][0] = g->n;
+                break;
+            case JMP:
+                g->succ[i][0] = graph_target(g, len, labels, ins[1]);
+                break;
+            case JMPEQ:
+            case JMPNE:
+            case JMPGT:
+            case JMPLT:
+                g->succ[i][1] = graph_target(g, len, labels, ins[1]);
+                g->succ_count[i] = 2;
+                break;
+        }
+        g->color[i] = 0;
+    }
+}
+
+// Depth first walk from i marking what is reachable. Returns 1 if it runs
+// into a loop.
+static int graph_visit(program_graph *g, int i)
+{
+    int loops = 0;
+    int s;
+
+    g->color[i] = 1;
+    for (int k = 0; k < g->succ_count[i]; k++) {
+        s = g->succ[i][k];
+        if (s == g->n) continue;
+        if (g->color[s] == 1) loops = 1;
+        if (g->color[s] == 0) loops |= graph_visit(g, s);
+    }
+    g->color[i] = 2;
+    return loops;
+}
+
+// Backward liveness. On leaving the program only R0 is live: every other
+// register is either zeroed or written before it is read by the next run.
+static void graph_liveness(program_graph *g, int *code, unsigned int *live, unsigned int *flags_live)
+{
+    unsigned int use, def, flag_use, flag_def, out, flags_out;
+    int changed = 1;
+
+    for (int i = 0; i < g->n; i++) {
+        live[i] = 0;
+        flags_live[i] = 0;
+    }
+    live[g->n] = BIT(R0);
+    flags_live[g->n] = 0;
+
+    while (changed) {
+        changed = 0;
+        for (int i = g->n - 1; i >= 0; i--) {
+            out = 0;
+            flags_out = 0;
+            for (int k = 0; k < g->succ_count[i]; k++) {
+                out |= live[g->succ[i][k]];
+                flags_out |= flags_live[g->succ[i][k]];
+            }
+            instruction_effects(&code[g->offset[i]], &use, &def, &flag_use, &flag_def);
+            out = use | (out & ~def);
+            flags_out = flag_use | (flags_out & ~flag_def);
+            if (out != live[i] || flags_out != flags_live[i]) {
+                live[i] = out;
+                flags_live[i] = flags_out;
+                changed = 1;
+            }
+        }
+    }
+}
+
+static int const_known(const_state *st, int r)
+{
+    return r != T0 && (st->known & BIT(r));
+}
+
+static void const_set(const_state *st, int r, int known, int value)
+{
+    if (known) {
+        st->known |= BIT(r);
+        st->value[r] = value;
+    } else {
+        st->known &= ~BIT(r);
+    }
+}
+
+static int flags_taken(int op, unsigned int flags)
+{
+    switch (op) {
+        case JMPEQ: return (flags & BIT(EQ)) != 0;
+        case JMPNE: return (flags & BIT(EQ)) == 0;
+        case JMPGT: return (flags & BIT(GT)) != 0;
+        case JMPLT: return (flags & BIT(LT)) != 0;
+        default: return 1;
+    }
+}
+
+static unsigned int compare_flags(int a, int b)
+{
+    return (a == b ? BIT(EQ) : 0) | (a < b ? BIT(LT) : 0) | (a > b ? BIT(GT) : 0);
+}
+
+static int fold_arithmetic(int op, int a, int b)
+{
+    switch (op) {
+        case ADD: return (int)((unsigned int)a + (unsigned int)b);
+        case SUB: return (int)((unsigned int)a - (unsigned int)b);
+        default: return (int)((unsigned int)a * (unsigned int)b);
+    }
+}
+
+static void const_apply(const_state *st, int *ins)
+{
+    int r = ins[1];
+    int both = const_known(st, I0) && const_known(st, I1);
+
+    switch (ins[0]) {
+        case STORE:
+            const_set(st, r, 1, ins[2]);
+            break;
+        case MOVE:
+            const_set(st, r, const_known(st, ins[2]), st->value[ins[2]]);
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+            const_set(st, O0, both, both ? fold_arithmetic(ins[0], st->value[I0], st->value[I1]) : 0);
+            break;
+        case INC:
+        case DEC:
+            const_set(st, r, const_known(st, r), st->value[r] + (ins[0] == INC ? 1 : -1));
+            break;
+        case INCEQ:
+        case DECEQ:
+            if (!st->flags_known) {
+                const_set(st, r, 0, 0);
+            } else if (st->flags & BIT(EQ)) {
+                const_set(st, r, const_known(st, r), st->value[r] + (ins[0] == INCEQ ? 1 : -1));
+            }
+            break;
+        case CMP:
+            st->flags_known = both;
+            st->flags = both ? compare_flags(st->value[I0], st->value[I1]) : 0;
+            break;
+        case SETF:
+            st->flags_known = 1;
+            st->flags = ins[1];
+            break;
+    }
+    st->known &= ~BIT(T0);
+}
+
+static int const_meet(const_state *into, const_state *from)
+{
+    unsigned int known;
+    int flags_known;
+
+    if (!into->seen) {
+        *into = *from;
+        return 1;
+    }
+
+    known = into->known & from->known;
+    for (int r = 0; r < REGISTERS_COUNT; r++) {
+        if ((known & BIT(r)) && into->value[r] != from->value[r]) {
+            known &= ~BIT(r);
+        }
+    }
+    flags_known = into->flags_known && from->flags_known && into->flags == from->flags;
+
+    if (known == into->known && flags_known == into->flags_known) return 0;
+    into->known = known;
+    into->flags_known = flags_known;
+    return 1;
+}
+
+// Writes the specialized form of one instruction and returns its length.
+static int spec_emit(int *out, int *ins, const_state *st)
+{
+    int r = ins[1];
+    int op = ins[0];
+
+    switch (op) {
+        case MOVE:
+            if (!const_known(st, ins[2])) break;
+            out[0] = STORE;
+            out[1] = r;
+            out[2] = st->value[ins[2]];
+            return 3;
+        case ADD:
+        case SUB:
+        case MUL:
+            if (!const_known(st, I0) || !const_known(st, I1)) break;
+            out[0] = STORE;
+            out[1] = O0;
+            out[2] = fold_arithmetic(op, st->value[I0], st->value[I1]);
+            return 3;
+        case INCEQ:
+        case DECEQ:
+            if (!st->flags_known) break;
+            if (!(st->flags & BIT(EQ))) return 0;
+            op = op == INCEQ ? INC : DEC;
+            // fall through
+        case INC:
+        case DEC:
+            if (!const_known(st, r)) {
+                out[0] = op;
+                out[1] = r;
+                return 2;
+            }
+            out[0] = STORE;
+            out[1] = r;
+            out[2] = st->value[r] + (op == INC ? 1 : -1);
+            return 3;
+        case CMP:
+            if (!const_known(st, I0) || !const_known(st, I1)) break;
+            out[0] = SETF;
+            out[1] = compare_flags(st->value[I0], st->value[I1]);
+            return 2;
+        case JMPEQ:
+        case JMPNE:
+        case JMPGT:
+        case JMPLT:
+            if (!st->flags_known) break;
+            if (!flags_taken(op, st->flags)) return 0;
+            out[0] = JMP;
+            out[1] = r;
+            return 2;
+    }
+
+    memcpy(out, ins, op_length(op) * sizeof(int));
+    return op_length(op);
+}
+
+// Drops instructions that only write a register nobody reads afterwards.
+// Returns the new length.
+static int spec_drop_dead_stores(program_graph *g, int *code, int len, int *labels)
+{
+    unsigned int live[PROGRAM_LIMIT + 1];
+    unsigned int flags_live[PROGRAM_LIMIT + 1];
+    unsigned int use, def, flag_use, flag_def, out;
+    int removed = 1;
+    int n;
+
+    while (removed) {
+        removed = 0;
+        link_labels(code, len, labels);
+        graph_build(g, code, len, labels);
+        graph_liveness(g, code, live, flags_live);
+
+        n = 0;
+        for (int i = 0; i < g->n; i++) {
+            int *ins = &code[g->offset[i]];
+            int l = g->offset[i + 1] - g->offset[i];
+            out = 0;
+            for (int k = 0; k < g->succ_count[i]; k++) {
+                out |= live[g->succ[i][k]];
+            }
+            instruction_effects(ins, &use, &def, &flag_use, &flag_def);
+            if (def && !(def & out)) {
+                removed = 1;
+                continue;
+            }
+            memmove(&code[n], ins, l * sizeof(int));
+            n += l;
+        }
+        len = n;
+    }
+    return len;
+}
+
+// Analyses a program and builds its specialized form in buf, which must
+// hold SPEC_CAPACITY(p->bytecode_len) ints. Registers that are never read
+// before being written are left alone on entry, C0 and E0 are only loaded
+// when read, and T0 is only kept current if something reads it.
+//
+// Loop free programs are also constant folded: compares of known values
+// become SETF, jumps on known flags become JMP or vanish, and stores left
+// dead by that are dropped. Programs with loops are not rewritten beyond
+// dropping unreachable code, so that running into a step limit happens at
+// the same point as in the original.
+void program_specialize(program *p, int *buf)
+{
+    program_graph graph;
+    const_state state[PROGRAM_LIMIT];
+    unsigned int live[PROGRAM_LIMIT + 1];
+    unsigned int flags_live[PROGRAM_LIMIT + 1];
+    unsigned int use, def, flag_use, flag_def;
+    program_graph *g = &graph;
+    program_spec *spec = &p->spec;
+    int *code = p->bytecode;
+    int len = p->bytecode_len;
+    int changed = 1;
+    int n = 0;
+    const_state st;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->code = buf;
+    if (buf == NULL || len > PROGRAM_LIMIT) return;
+
+    graph_build(g, code, len, p->labels);
+    spec->loops = g->n > 0 && graph_visit(g, 0);
+
+    graph_liveness(g, code, live, flags_live);
+    spec->live_in = live[0];
+    spec->flags_live_in = flags_live[0];
+    for (int i = 0; i < g->n; i++) {
+        // Jumps land past a LABEL, so labels only mark places and are
+        // left out of the counts
+        if (code[g->offset[i]] == LABEL) continue;
+        spec->instructions++;
+        if (!g->color[i]) continue;
+        spec->reachable++;
+        instruction_effects(&code[g->offset[i]], &use, &def, &flag_use, &flag_def);
+        spec->reads |= use;
+        spec->writes |= def;
+        spec->flag_reads |= flag_use;
+        spec->flag_writes |= flag_def;
+    }
+
+    // Registers read before written start out as zero, except the ones
+    // loaded with hit points. R0 is always zeroed as it is the result.
+    spec->clear = (spec->live_in | BIT(R0)) & ~(BIT(C0) | BIT(E0) | BIT(T0));
+
+    memset(state, 0, g->n * sizeof(const_state));
+    if (g->n > 0) {
+        state[0].seen = 1;
+        state[0].known = spec->clear;
+    }
+    while (!spec->loops && changed) {
+        changed = 0;
+        for (int i = 0; i < g->n; i++) {
+            if (!state[i].seen) continue;
+            st = state[i];
+            const_apply(&st, &code[g->offset[i]]);
+            for (int k = 0; k < g->succ_count[i]; k++) {
+                // Skip the branch a jump on known flags never takes
+                if (g->succ_count[i] == 2 && st.flags_known
+                        && (k == 1) != flags_taken(code[g->offset[i]], st.flags)) continue;
+                if (g->succ[i][k] != g->n) {
+                    changed |= const_meet(&state[g->succ[i][k]], &st);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < g->n; i++) {
+        int *ins = &code[g->offset[i]];
+        if (ins[0] == LABEL || (g->color[i] && spec->loops)) {
+            memcpy(&buf[n], ins, op_length(ins[0]) * sizeof(int));
+            n += op_length(ins[0]);
+        } else if (state[i].seen) {
+            n += spec_emit(&buf[n], ins, &state[i]);
+        }
+    }
+    if (!spec->loops) {
+        n = spec_drop_dead_stores(g, buf, n, spec->labels);
+    }
+    spec->code_len = n;
+    link_labels(buf, n, spec->labels);
+
+    // Set up only what the final code needs
+    graph_build(g, buf, n, spec->labels);
+    graph_liveness(g, buf, live, flags_live);
+    spec->load = live[0];
+    spec->clear = (live[0] | BIT(R0)) & ~(BIT(C0) | BIT(E0) | BIT(T0));
+    for (int i = 0; i < g->n; i++) {
+        instruction_effects(&buf[g->offset[i]], &use, &def, &flag_use, &flag_def);
+        spec->ticks |= (use & BIT(T0)) != 0;
+    }
+    spec->specialized = 1;
+}
+
+void program_free(program *p)
+{
+    free(p->asmcode);
+    free(p->bytecode);
+    free(p->spec.code);
+    p->asmcode = NULL;
+    p->bytecode = NULL;
+    p->spec.code = NULL;
+}
+
+int parse_code(program *user_program)
 {
     char *p = user_program->asmcode;
     char *end = p + user_program->asmcode_len;
@@ -367,6 +958,7 @@ void parse_code(program *user_program)
                 check((t = skip_comma(t, end)));
                 check((t = skip_space(t, end)));
                 check((t_end = next_eol(t, end)));
+                check(t_end - t < sizeof(buf));
                 check(memcpy(buf, t, t_end - t));
 
                 // Convert text to int
@@ -438,17 +1030,15 @@ void parse_code(program *user_program)
                 t += strlen(ops_enum_strings[opcode]);
                 check((t = skip_space(t, end)));
                 check((t_end = next_eol(t, end)));
+                check(t_end - t < sizeof(buf));
                 check(memcpy(buf, t, t_end - t));
 
                 v = strtol(buf, NULL, 0);
+                check(v >= 0 && v < LABEL_LIMIT);
                 program_set_bytecode(user_program, v);
 
                 p = t_end;
 
-                if (opcode == LABEL) {
-                    user_program->labels[v] = user_program->bytecode_len - 1;
-                }
-
             }
             break;
             case CMP:
@@ -464,52 +1054,196 @@ void parse_code(program *user_program)
                 break;
             }
             case OPS_COUNT:
+            case SETF:
             {
                 break;
             }
         }
     }
 
-    return;
+    program_link_labels(user_program);
+    free(user_program->spec.code);
+    program_specialize(user_program, user_program->bytecode_len <= PROGRAM_LIMIT
+            ? malloc(sizeof(int) * SPEC_CAPACITY(user_program->bytecode_len)) : NULL);
+    return 0;
 
 error:
-    exit(100);
+    return -1;
 
 }
 
-void fightvm_init()
+// Prints bytecode as assembly in the same layout as the bundled bots: code
+// after a LABEL is indented until the next LABEL.
+static void print_code(FILE *fp, int *code, int len)
 {
-    srand(SDL_GetTicks());
-    SDL_Delay(500);
+    const char *indent = "";
+
+    for (int ip = 0; ip < len; ip += op_length(code[ip])) {
+        switch (code[ip]) {
+            case STORE:
+                fprintf(fp, "%sSTORE %s, %d\n", indent,
+                        registers_enum_strings[code[ip + 1]], code[ip + 2]);
+                break;
+            case MOVE:
+                fprintf(fp, "%sMOVE %s, %s\n", indent,
+                        registers_enum_strings[code[ip + 1]],
+                        registers_enum_strings[code[ip + 2]]);
+                break;
+            case INC:
+            case DEC:
+            case INCEQ:
+            case DECEQ:
+                fprintf(fp, "%s%s %s\n", indent, ops_enum_strings[code[ip]],
+                        registers_enum_strings[code[ip + 1]]);
+                break;
+            case LABEL:
+                fprintf(fp, "\nLABEL %d\n", code[ip + 1]);
+                indent = "    ";
+                break;
+            case JMP:
+            case JMPEQ:
+            case JMPNE:
+            case JMPGT:
+            case JMPLT:
+                fprintf(fp, "%s%s %d\n", indent, ops_enum_strings[code[ip]], code[ip + 1]);
+                break;
+            case SETF:
+                // Not valid assembly, only found in specialized code
+                fprintf(fp, "%sSETF %d\n", indent, code[ip + 1]);
+                break;
+            default:
+                fprintf(fp, "%s%s\n", indent, ops_enum_strings[code[ip]]);
+                break;
+        }
+    }
 }
 
-static void vertline(int x, int y1, int y2, int c)
+int write_code(const char *path, program *p)
 {
-    for (int i = y1; i < y2; i++) {
-        cpu_texture.pixels[i * W + x] = c; 
+    FILE *fp;
+
+    check((fp = fopen(path, "w")));
+    print_code(fp, p->bytecode, p->bytecode_len);
+    check(fclose(fp) == 0);
+    return 0;
+
+error:
+    return -1;
+}
+
+static void print_mask(const char *label, unsigned int mask, const char **names, int count)
+{
+    printf("%s", label);
+    for (int i = 0; i < count; i++) {
+        if (mask & BIT(i)) printf(" %s", names[i]);
     }
+    if (mask == 0) printf(" -");
+    printf("\n");
 }
 
-static void draw()
+// fightvm analyze <program.asm...>
+//
+// Prints what the dataflow analysis found for each program, warns about
+// reads of state that was never set, and lists the specialized code.
+int fightvm_analyze_main(int argc, char *argv[])
 {
-    int hp;
-    double scale;
+    static program p;
+    const unsigned int loaded = BIT(C0) | BIT(E0) | BIT(T0);
+    int status = 0;
+
+    for (int i = 2; i < argc; i++) {
+        program_free(&p);
+        memset(&p, 0, sizeof(p));
+        if (read_code(argv[i], &p) <= 0 || parse_code(&p) != 0) {
+            fprintf(stderr, "Error loading %s\n", argv[i]);
+            status = 100;
+            continue;
+        }
 
-    memset(cpu_texture.pixels, 0, W * H * sizeof(Uint32));
+        program_spec *spec = &p.spec;
+        printf("%s\n", argv[i]);
+        if (!spec->specialized) {
+            printf("    too long to analyze\n\n");
+            continue;
+        }
+        printf("    instructions: %d, %d reachable%s; %zu words, %zu after specializing\n",
+                spec->instructions, spec->reachable, spec->loops ? ", loops" : "",
+                p.bytecode_len, spec->code_len);
+        print_mask("    reads:", spec->reads, registers_enum_strings, REGISTERS_COUNT);
+        print_mask("    writes:", spec->writes, registers_enum_strings, REGISTERS_COUNT);
+        print_mask("    flags read:", spec->flag_reads, flags_enum_strings, FLAGS_COUNT);
+        print_mask("    cleared:", spec->clear, registers_enum_strings, REGISTERS_COUNT);
+        print_mask("    loaded:", spec->load & loaded, registers_enum_strings, REGISTERS_COUNT);
+
+        for (int r = 0; r < REGISTERS_COUNT; r++) {
+            if (r == R0 || !(spec->live_in & BIT(r)) || (loaded & BIT(r))) continue;
+            printf("    warning: %s may be read before it is written, it is always 0\n",
+                    registers_enum_strings[r]);
+        }
+        if (spec->live_in & BIT(R0)) {
+            printf("    warning: R0 may be read or returned before it is written, "
+                    "it is 0 (DEFEND)\n");
+        }
+        for (int f = 0; f < FLAGS_COUNT; f++) {
+            if (!(spec->flags_live_in & BIT(f))) continue;
+            printf("    warning: %s may be read before a CMP, it is left from the last round\n",
+                    flags_enum_strings[f]);
+        }
 
-    scale = ((double)user_program[0].hp / (double)MAX_HP);
-    hp = scale * W;
-    for (int i = 0; i < hp; i++) {
-       vertline(i, 0, (H / 2) - 1, 0xff000000); 
+        printf("\n");
+        print_code(stdout, spec->code, spec->code_len);
+        printf("\n");
     }
-    scale = ((double)user_program[1].hp / (double)MAX_HP);
-    hp = scale * W;
-    for (int i = 0; i < hp; i++) {
-       vertline(i, H / 2, H - 1, 0x0000ff00); 
+    program_free(&p);
+    return status;
+}
+
+void fightvm_init()
+{
+    current_match.seed = SDL_GetTicks();
+    SDL_Delay(500);
+}
+
+typedef enum {
+    GRID_LIMIT = 1024,
+    GRID_ROUNDS_PER_JOB = 64,
+} grid_limits_enum;
+
+static SDL_Rect bar_rects[PROGRAM_COUNT][GRID_LIMIT];
+
+// Draws the hp bars of n matches laid out in a grid of W x H cells, one
+// filled rectangle per bar and one draw call per player colour. With more
+// than one column a pixel is left between neighbouring cells.
+static void draw_matches(int (*hp)[PROGRAM_COUNT], int n, int columns)
+{
+    int span = columns > 1 ? W - 1 : W;
+    SDL_Rect *r;
+
+    n = n > GRID_LIMIT ? GRID_LIMIT : n;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < PROGRAM_COUNT; j++) {
+            r = &bar_rects[j][i];
+            r->x = (i % columns) * W;
+            r->y = (i / columns) * H + j * (H / 2);
+            r->w = ((double)hp[i][j] / (double)MAX_HP) * span;
+            r->h = (H / 2) - 1;
+        }
     }
+
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+    SDL_RenderFillRects(renderer, bar_rects[0], n);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
+    SDL_RenderFillRects(renderer, bar_rects[1], n);
+}
+
+static void draw()
+{
+    draw_matches(&current_match.hp, 1, 1);
 }
 
-static void sync()
+static void sync_frame()
 {
     // Tick
     static Uint32 current_millis;
@@ -525,43 +1259,56 @@ static void sync()
     }
     last_millis = current_millis;
 
-    // Update the gpu texture
-    SDL_Rect r = {.w = cpu_texture.w,.h = cpu_texture.h,.x = 0,.y = 0 };
-    SDL_UpdateTexture(gpu_texture, &r, cpu_texture.pixels,
-		      cpu_texture.w * sizeof(Uint32));
-    SDL_RenderCopy(renderer, gpu_texture, NULL, NULL);
-
-    // Do hardware drawing
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-   
     // Present
     SDL_RenderPresent(renderer);
 
 }
 
 #define ipcode (code[ip])
-int fightvm_run_program(int program_index)
+int fightvm_run_program(match *m, int program_index)
 {
-    program *p = &user_program[program_index];
+    program *p = m->fighter[program_index];
+    int *registers = m->registers;
+    int *flags = m->flags;
     register int i0 = 0;
     register int i1 = 0;
     int ip = 0;
+    int steps = 0;
+    int step_limit = m->step_limit;
     register int op = 0;
     int *code = p->bytecode;
     int len = p->bytecode_len;
-
-    memset(registers, 0, sizeof(registers));
-
-    if (program_index == 0) {
-        registers[C0] = user_program[0].hp;
-        registers[E0] = user_program[1].hp;
+    int *labels = p->labels;
+    unsigned int load = BIT(C0) | BIT(E0);
+    int ticks = 1;
+
+    if (p->spec.specialized) {
+        code = p->spec.code;
+        len = p->spec.code_len;
+        labels = p->spec.labels;
+        load = p->spec.load;
+        ticks = p->spec.ticks;
+        for (int r = 0; r < REGISTERS_COUNT; r++) {
+            if (p->spec.clear & BIT(r)) {
+                registers[r] = 0;
+            }
+        }
     } else {
-        registers[C0] = user_program[1].hp;
-        registers[E0] = user_program[0].hp;
+        memset(registers, 0, sizeof(m->registers));
+    }
+
+    if (load & BIT(C0)) {
+        registers[C0] = m->hp[program_index];
+    }
+    if (load & BIT(E0)) {
+        registers[E0] = m->hp[!program_index];
     }
 
-    while(ip < len && (op = p->bytecode[ip]) != -1) {
-        registers[T0] = SDL_GetTicks();
+    while(ip < len && (op = code[ip]) != -1
+            && (step_limit == 0 || steps++ < step_limit)) {
+        if (ticks) {
+            registers[T0] = SDL_GetTicks();
+        }
         switch(op){
 
             case STORE:
@@ -643,11 +1390,20 @@ int fightvm_run_program(int program_index)
                 flags[ER] = 0;
                 break;
 
+            case SETF:
+                ip++;
+                i0 = code[ip];
+                flags[EQ] = (i0 & BIT(EQ)) != 0;
+                flags[LT] = (i0 & BIT(LT)) != 0;
+                flags[GT] = (i0 & BIT(GT)) != 0;
+                flags[ER] = 0;
+                break;
+
             case JMPEQ:
                 ip++;
                 i0 = code[ip];
                 if (flags[EQ]) {
-                    ip = p->labels[i0];
+                    ip = labels[i0];
                 }
                 break;
 
@@ -655,7 +1411,7 @@ int fightvm_run_program(int program_index)
                 ip++;
                 i0 = code[ip];
                 if (!flags[EQ]) {
-                    ip = p->labels[i0];
+                    ip = labels[i0];
                 }
                 break;
 
@@ -663,7 +1419,7 @@ int fightvm_run_program(int program_index)
                 ip++;
                 i0 = code[ip];
                 if (flags[GT]) {
-                    ip = p->labels[i0];
+                    ip = labels[i0];
                 }
                 break;
 
@@ -671,14 +1427,14 @@ int fightvm_run_program(int program_index)
                 ip++;
                 i0 = code[ip];
                 if (flags[LT]) {
-                    ip = p->labels[i0];
+                    ip = labels[i0];
                 }
                 break;
 
             case JMP:
                 ip++;
                 i0 = code[ip];
-                ip = p->labels[i0];
+                ip = labels[i0];
                 break;
         }
         ip++;
@@ -690,14 +1446,14 @@ int fightvm_run_program(int program_index)
 
 }
 
-void fightvm_resolve_round(int results[])
+void fightvm_resolve_round(match *m, int results[])
 {
     for (int i = 0; i < PROGRAM_COUNT; i++) {
         if (results[i] == Gamble) {
-            int gamble_win = randrange(1, 100) > 90;
+            int gamble_win = randrange(&m->seed, 1, 100) > 90;
             results[i] = gamble_win ? Attack : Defend;
             if (gamble_win) {
-                user_program[i].strength++;
+                m->strength[i]++;
             }
         }
     }
@@ -709,109 +1465,2223 @@ void fightvm_resolve_round(int results[])
         t = &result_table[i];
         if (t->program_one_intent == results[0] && t->program_two_intent == results[1]) {
 
-            damage = (t->program_one_damage_taken * user_program[1].strength);
-            user_program[0].hp -= damage;
-            printf("%s takes %d damage.\n", user_program[0].name, damage); 
-            
-            damage = (t->program_two_damage_taken * user_program[0].strength);
-            user_program[1].hp -= damage;
-            printf("%s takes %d damage.\n", user_program[1].name, damage); 
+            damage = (t->program_one_damage_taken * m->strength[1]);
+            m->hp[0] -= damage;
+            if (m->verbose) {
+                printf("%s takes %d damage.\n", m->fighter[0]->name, damage);
+            }
+
+            damage = (t->program_two_damage_taken * m->strength[0]);
+            m->hp[1] -= damage;
+            if (m->verbose) {
+                printf("%s takes %d damage.\n", m->fighter[1]->name, damage);
+            }
 
         }
     }
 
-    if (user_program[0].hp < 0) { user_program[0].hp = 0; }
-    if (user_program[1].hp < 0) { user_program[1].hp = 0; }
+    if (m->hp[0] < 0) { m->hp[0] = 0; }
+    if (m->hp[1] < 0) { m->hp[1] = 0; }
 }
 
-void fightvm_program_loop()
+void fightvm_reset_match(match *m)
 {
-    int rounds = 0;
-    int result[PROGRAM_COUNT];
-    
-    user_program[0].hp = MAX_HP;
-    user_program[0].strength = 1;
-    user_program[1].hp = MAX_HP;
-    user_program[1].strength = 1;
-
-
-    while (!done() && user_program[0].hp > 0 && user_program[1].hp > 0) {
-        rounds++;
-        result[0] = fightvm_run_program(0);
-        result[1] = fightvm_run_program(1);
-        printf("%s has chosen to %s.\n", user_program[0].name,
-                program_result_enum_strings_lower[result[0]]);
-        printf("%s has chosen to %s.\n", user_program[1].name,
-                program_result_enum_strings_lower[result[1]]);
-
-        fightvm_resolve_round(result);
+    for (int i = 0; i < PROGRAM_COUNT; i++) {
+        m->hp[i] = MAX_HP;
+        m->strength[i] = 1;
+    }
+    memset(m->flags, 0, sizeof(m->flags));
+    memset(m->registers, 0, sizeof(m->registers));
+    m->rounds = 0;
+}
 
-        draw();
-        sync();
+int fightvm_match_over(match *m)
+{
+    return m->hp[0] <= 0 || m->hp[1] <= 0 || m->rounds >= ROUND_LIMIT;
+}
 
-        puts("--------------------");
+void fightvm_play_round(match *m)
+{
+    int result[PROGRAM_COUNT];
 
+    m->rounds++;
+    result[0] = fightvm_run_program(m, 0);
+    result[1] = fightvm_run_program(m, 1);
+    if (m->verbose) {
+        for (int i = 0; i < PROGRAM_COUNT; i++) {
+            printf("%s has chosen to %s.\n", m->fighter[i]->name,
+                    program_result_enum_strings_lower[result[i]]);
+        }
     }
+    fightvm_resolve_round(m, result);
+}
 
-    printf("%s has %d hitpoints left after %d rounds.\n", user_program[0].name, user_program[0].hp, rounds);
-    printf("%s has %d hitpoints left after %d rounds.\n", user_program[1].name, user_program[1].hp, rounds);
-
-    while (!done()) {
-        SDL_Delay(100);
+// Plays a whole match without any rendering. Returns the index of the
+// winning program, or -1 for a draw. A match that hits ROUND_LIMIT is decided
+// on remaining hp.
+int fightvm_play_match(match *m)
+{
+    fightvm_reset_match(m);
+    while (!fightvm_match_over(m)) {
+        fightvm_play_round(m);
     }
 
+    if (m->hp[0] > m->hp[1]) return 0;
+    if (m->hp[1] > m->hp[0]) return 1;
+    return -1;
 }
-    
-int main(int argc, char *argv[])
-{
-    if (argc != 3) return 0;
-    const char *code1_path_arg = argv[1];
-    const char *code2_path_arg = argv[2];
 
-    // sdl init
-    SDL_Init(SDL_INIT_EVERYTHING);
+// Randomness only enters a match through a Gamble or through reading T0.
+// A program is deterministic if it never reads T0 and every write to R0 is
+// a STORE of something other than Gamble. This is conservative: a program
+// that computes R0 is assumed to be able to gamble. The specialized code is
+// checked when there is one, as it has unreachable code removed and known
+// values folded into STOREs.
+int program_is_deterministic(program *p)
+{
+    int *code = p->spec.specialized ? p->spec.code : p->bytecode;
+    int len = p->spec.specialized ? p->spec.code_len : p->bytecode_len;
 
-    // no filtering
+    for (int ip = 0; ip < len; ip += op_length(code[ip])) {
+        switch (code[ip]) {
+            case STORE:
+                if (code[ip + 1] == R0 && code[ip + 2] == Gamble) return 0;
+                break;
+            case MOVE:
+                if (code[ip + 1] == R0 || code[ip + 2] == T0) return 0;
+                break;
+            case INC:
+            case DEC:
+            case INCEQ:
+            case DECEQ:
+                if (code[ip + 1] == R0) return 0;
+                break;
+        }
+    }
+    return 1;
+}
+
+#define SAMPLE_HALF_WIDTH 0.05
+#define SAMPLE_Z 1.96
+#define SPRT_DELTA 0.05
+#define SPRT_ALPHA 0.05
+#define SPRT_BETA 0.05
+
+typedef enum {
+    SAMPLE_MIN = 8,
+    SAMPLE_MAX = 100000,
+} sample_limits_enum;
+
+typedef struct sample_config {
+    double half_width;
+    int max_matches;
+    unsigned int seed;
+
+    // When 0, exactly max_matches are played.
+    int adaptive;
+    int step_limit;
+} sample_config;
+
+typedef struct sample_result {
+    int matches;
+    int wins[PROGRAM_COUNT];
+    int draws;
+    int rounds;
+
+    // Program one's score, a draw counting as half a win.
+    double score;
+    double half_width;
+
+    // 1 if program one was found stronger, -1 if program two, 0 if undecided.
+    int sprt;
+    int deterministic;
+} sample_result;
+
+static unsigned int match_seed(unsigned int seed, int i)
+{
+    return seed + i * 2654435761u;
+}
+
+// Wilson score interval half width for a proportion p over n trials.
+static double wilson_half_width(double p, int n)
+{
+    double z2 = SAMPLE_Z * SAMPLE_Z;
+    return SAMPLE_Z / (1 + z2 / n) * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n));
+}
+
+// Plays a and b against each other until the confidence interval on a's
+// score is narrower than cfg->half_width, or a sequential probability ratio
+// test decides that one of them is stronger than the other by SPRT_DELTA.
+// A pair that can not gamble is played exactly once. Without
+// cfg->adaptive the pair is played cfg->max_matches times, or for a pair
+// that can not gamble, once and counted cfg->max_matches times.
+void fightvm_sample_pair(program *a, program *b, sample_config *cfg, sample_result *r)
+{
+    match m;
+    double llr = 0;
+    double p0 = 0.5 - SPRT_DELTA;
+    double p1 = 0.5 + SPRT_DELTA;
+    double lower = log(SPRT_BETA / (1 - SPRT_ALPHA));
+    double upper = log((1 - SPRT_BETA) / SPRT_ALPHA);
+    double x;
+    int winner;
+
+    memset(r, 0, sizeof(*r));
+    memset(&m, 0, sizeof(m));
+    m.fighter[0] = a;
+    m.fighter[1] = b;
+    m.step_limit = cfg->step_limit;
+    r->deterministic = program_is_deterministic(a) && program_is_deterministic(b);
+
+    while (r->matches < cfg->max_matches) {
+        m.seed = match_seed(cfg->seed, r->matches);
+        winner = fightvm_play_match(&m);
+        r->matches++;
+        r->rounds += m.rounds;
+        if (winner == -1) {
+            r->draws++;
+            x = 0.5;
+        } else {
+            r->wins[winner]++;
+            x = winner == 0 ? 1 : 0;
+        }
+
+        r->score = (r->wins[0] + 0.5 * r->draws) / r->matches;
+        r->half_width = wilson_half_width(r->score, r->matches);
+        if (r->deterministic) {
+            r->half_width = 0;
+            if (!cfg->adaptive) {
+                r->wins[0] *= cfg->max_matches;
+                r->wins[1] *= cfg->max_matches;
+                r->draws *= cfg->max_matches;
+                r->rounds *= cfg->max_matches;
+                r->matches = cfg->max_matches;
+            }
+            break;
+        }
+
+        llr += x * log(p1 / p0) + (1 - x) * log((1 - p1) / (1 - p0));
+        if (llr >= upper) { r->sprt = 1; }
+        if (llr <= lower) { r->sprt = -1; }
+
+        if (!cfg->adaptive || r->matches < SAMPLE_MIN) continue;
+        if (r->sprt != 0 || r->half_width < cfg->half_width) break;
+    }
+}
+
+// fightvm sample <a.asm> <b.asm> [half_width] [max_matches] [seed]
+int fightvm_sample_main(int argc, char *argv[])
+{
+    sample_config cfg = {
+        .half_width = SAMPLE_HALF_WIDTH,
+        .max_matches = SAMPLE_MAX,
+        .seed = time(NULL),
+        .adaptive = 1,
+    };
+    sample_result r;
+    const char *stronger = "undecided";
+
+    if (argc < 4) return 0;
+    if (argc > 4) cfg.half_width = strtod(argv[4], NULL);
+    if (argc > 5) cfg.max_matches = strtol(argv[5], NULL, 0);
+    if (argc > 6) cfg.seed = strtoul(argv[6], NULL, 0);
+
+    for (int i = 0; i < PROGRAM_COUNT; i++) {
+        if ((int)read_code(argv[2 + i], &user_program[i]) <= 0) {
+            fprintf(stderr, "Error reading %s\n", argv[2 + i]);
+            return 1;
+        }
+        if (parse_code(&user_program[i]) != 0) return 100;
+    }
+
+    fightvm_sample_pair(&user_program[0], &user_program[1], &cfg, &r);
+
+    if (r.sprt == 1) stronger = user_program[0].name;
+    if (r.sprt == -1) stronger = user_program[1].name;
+
+    printf("%s won %d, %s won %d, %d draws over %d matches%s.\n",
+            user_program[0].name, r.wins[0], user_program[1].name, r.wins[1],
+            r.draws, r.matches, r.deterministic ? " (deterministic)" : "");
+    printf("%s scores %.3f +/- %.3f, sprt: %s.\n",
+            user_program[0].name, r.score, r.half_width, stronger);
+    return 0;
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef enum {
+    POOL_THREAD_LIMIT = 64,
+} pool_limits_enum;
+
+typedef void (*pool_job)(void *ctx, int job);
+typedef void (*pool_tick)(void *ctx);
+
+// A batch of jobs handed to pool_run. It lives on the caller's stack and
+// is queued on the pool until all its jobs are taken.
+typedef struct pool_batch {
+    pool_job fn;
+    void *ctx;
+    int next_job;
+    int job_count;
+    int running;
+    struct pool_batch *next;
+} pool_batch;
+
+// A fixed set of threads that run batches of independent jobs. Threads are
+// started once and parked between batches, so running a batch allocates
+// nothing. Batches from different callers are served in turn, one job at a
+// time, so a short batch does not wait behind a long one.
+typedef struct worker_pool {
+    pthread_t thread[POOL_THREAD_LIMIT];
+    int thread_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+
+    pool_batch *head;
+    pool_batch *tail;
+    int quit;
+} worker_pool;
+
+static void pool_queue(worker_pool *pool, pool_batch *b)
+{
+    b->next = NULL;
+    if (pool->tail) {
+        pool->tail->next = b;
+    } else {
+        pool->head = b;
+    }
+    pool->tail = b;
+}
+
+static void *pool_worker(void *arg)
+{
+    worker_pool *pool = arg;
+    pool_batch *b;
+    int job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->head == NULL) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->quit) break;
+
+        // Take one job from the front batch and move it to the back
+        b = pool->head;
+        pool->head = b->next;
+        if (pool->head == NULL) pool->tail = NULL;
+        job = b->next_job++;
+        b->running++;
+        if (b->next_job < b->job_count) {
+            pool_queue(pool, b);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        b->fn(b->ctx, job);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--b->running == 0 && b->next_job == b->job_count) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int pool_thread_count()
+{
+    int n = get_nprocs();
+    return CLAMP(n, 1, POOL_THREAD_LIMIT);
+}
+
+void pool_start(worker_pool *pool, int thread_count)
+{
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    pool->thread_count = CLAMP(thread_count, 1, POOL_THREAD_LIMIT);
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_create(&pool->thread[i], NULL, pool_worker, pool);
+    }
+}
+
+// Like pool_run, and calls tick(ctx) from the calling thread every
+// interval seconds until the batch is done.
+void pool_run_ticking(worker_pool *pool, pool_job fn, void *ctx, int job_count,
+        pool_tick tick, int interval)
+{
+    pool_batch b = { .fn = fn, .ctx = ctx, .job_count = job_count };
+    struct timespec deadline;
+
+    if (job_count <= 0) return;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += interval;
+
+    pthread_mutex_lock(&pool->lock);
+    pool_queue(pool, &b);
+    pthread_cond_broadcast(&pool->wake);
+    while (b.next_job < b.job_count || b.running > 0) {
+        if (tick == NULL) {
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        } else if (pthread_cond_timedwait(&pool->idle, &pool->lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&pool->lock);
+            tick(ctx);
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += interval;
+            pthread_mutex_lock(&pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Runs fn(ctx, 0) .. fn(ctx, job_count - 1) across the pool and waits for
+// all of them to finish. Several callers may run batches at the same time.
+void pool_run(worker_pool *pool, pool_job fn, void *ctx, int job_count)
+{
+    pool_run_ticking(pool, fn, ctx, job_count, NULL, 0);
+}
+
+void pool_stop(worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->thread[i], NULL);
+    }
+}
+
+#define EVOLVE_PARSIMONY 0.0005
+
+typedef enum {
+    EVOLVE_POPULATION = 64,
+    EVOLVE_SURVIVORS = 16,
+    EVOLVE_OPPONENT_LIMIT = 16,
+    EVOLVE_MATCHES = 16,
+    EVOLVE_WRITE = 4,
+    EVOLVE_WRITE_INTERVAL = 10,
+} evolve_limits_enum;
+
+typedef struct candidate {
+    program prog;
+    int code[PROGRAM_LIMIT];
+    int spec_code[SPEC_CAPACITY(PROGRAM_LIMIT)];
+    int deterministic;
+
+    double score_sum;
+    int score_count;
+    double fitness;
+} candidate;
+
+// Candidates live in a fixed array and are recycled through a free list, so
+// the generation loop never touches the heap.
+typedef struct candidate_pool {
+    candidate slot[EVOLVE_POPULATION];
+    candidate *free[EVOLVE_POPULATION];
+    int free_count;
+} candidate_pool;
+
+typedef struct evolution {
+    candidate_pool pool;
+    candidate *population[EVOLVE_POPULATION];
+
+    program *opponent[EVOLVE_OPPONENT_LIMIT];
+    int opponent_deterministic[EVOLVE_OPPONENT_LIMIT];
+    int opponent_count;
+
+    double job_score[EVOLVE_POPULATION * EVOLVE_OPPONENT_LIMIT * PROGRAM_COUNT];
+    int job_matches[EVOLVE_POPULATION * EVOLVE_OPPONENT_LIMIT * PROGRAM_COUNT];
+
+    unsigned int seed;
+    unsigned int generation;
+} evolution;
+
+static evolution evolve_state;
+static program evolve_opponent[EVOLVE_OPPONENT_LIMIT];
+
+static void candidate_pool_init(candidate_pool *pool)
+{
+    pool->free_count = 0;
+    for (int i = 0; i < EVOLVE_POPULATION; i++) {
+        pool->free[pool->free_count++] = &pool->slot[i];
+    }
+}
+
+static candidate *candidate_alloc(candidate_pool *pool)
+{
+    candidate *c = pool->free[--pool->free_count];
+    c->prog.name = "evolved";
+    c->prog.bytecode = c->code;
+    c->prog.bytecode_len = 0;
+    c->score_sum = 0;
+    c->score_count = 0;
+    c->fitness = 0;
+    return c;
+}
+
+static void candidate_free(candidate_pool *pool, candidate *c)
+{
+    pool->free[pool->free_count++] = c;
+}
+
+// Fills offsets with the start of every instruction plus the end of the
+// program and returns the number of instructions.
+static int instruction_offsets(int *code, int len, int *offsets)
+{
+    int n = 0;
+    for (int ip = 0; ip < len; ip += op_length(code[ip])) {
+        offsets[n++] = ip;
+    }
+    offsets[n] = len;
+    return n;
+}
+
+static int random_instruction(unsigned int *seed, int *out)
+{
+    int op = randrange(seed, 0, OPS_COUNT - 1);
+    out[0] = op;
+    switch (op) {
+        case STORE:
+            out[1] = randrange(seed, 0, REGISTERS_COUNT - 1);
+            out[2] = out[1] == R0 ? randrange(seed, Defend, Gamble) : randrange(seed, 0, MAX_HP);
+            break;
+        case MOVE:
+            out[1] = randrange(seed, 0, REGISTERS_COUNT - 1);
+            out[2] = randrange(seed, 0, REGISTERS_COUNT - 1);
+            break;
+        case INC:
+        case DEC:
+        case INCEQ:
+        case DECEQ:
+            out[1] = randrange(seed, 0, REGISTERS_COUNT - 1);
+            break;
+        case LABEL:
+        case JMP:
+        case JMPEQ:
+        case JMPNE:
+        case JMPGT:
+        case JMPLT:
+            out[1] = randrange(seed, 0, LABEL_LIMIT - 1);
+            break;
+    }
+    return op_length(op);
+}
+
+// Changes one instruction in place without changing its length.
+static void mutate_instruction(unsigned int *seed, int *ins)
+{
+    int coin = randrange(seed, 0, 1);
+    switch (ins[0]) {
+        case STORE:
+            if (coin) {
+                ins[1] = randrange(seed, 0, REGISTERS_COUNT - 1);
+            }
+            if (ins[1] == R0) {
+                ins[2] = randrange(seed, Defend, Gamble);
+            } else if (!coin) {
+                ins[2] = CLAMP(ins[2] + randrange(seed, -MAX_HP / 10, MAX_HP / 10), 0, MAX_HP);
+            }
+            break;
+        case MOVE:
+            ins[1 + coin] = randrange(seed, 0, REGISTERS_COUNT - 1);
+            break;
+        case INC:
+        case DEC:
+        case INCEQ:
+        case DECEQ:
+            if (coin) {
+                ins[0] = randrange(seed, INC, DECEQ);
+            } else {
+                ins[1] = randrange(seed, 0, REGISTERS_COUNT - 1);
+            }
+            break;
+        case LABEL:
+            ins[1] = randrange(seed, 0, LABEL_LIMIT - 1);
+            break;
+        case JMP:
+        case JMPEQ:
+        case JMPNE:
+        case JMPGT:
+        case JMPLT:
+            if (coin) {
+                ins[0] = randrange(seed, JMP, JMPLT);
+            } else {
+                ins[1] = randrange(seed, 0, LABEL_LIMIT - 1);
+            }
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+        case CMP:
+            ins[0] = coin ? randrange(seed, ADD, MUL) : CMP;
+            break;
+    }
+}
+
+static void candidate_mutate(unsigned int *seed, candidate *c)
+{
+    int offsets[PROGRAM_LIMIT + 1];
+    int ins[3];
+    int *code = c->code;
+    int len = c->prog.bytecode_len;
+    int n = instruction_offsets(code, len, offsets);
+    int k, l;
+
+    switch (randrange(seed, 0, 3)) {
+        case 0:
+            // Insert a random instruction
+            k = offsets[randrange(seed, 0, n)];
+            l = random_instruction(seed, ins);
+            if (len + l > PROGRAM_LIMIT) break;
+            memmove(&code[k + l], &code[k], (len - k) * sizeof(int));
+            memcpy(&code[k], ins, l * sizeof(int));
+            len += l;
+            break;
+        case 1:
+            // Delete an instruction
+            if (n <= 1) break;
+            k = randrange(seed, 0, n - 1);
+            l = offsets[k + 1] - offsets[k];
+            memmove(&code[offsets[k]], &code[offsets[k + 1]], (len - offsets[k + 1]) * sizeof(int));
+            len -= l;
+            break;
+        default:
+            if (n == 0) break;
+            mutate_instruction(seed, &code[offsets[randrange(seed, 0, n - 1)]]);
+            break;
+    }
+
+    c->prog.bytecode_len = len;
+}
+
+// Copies whole instructions only, up to PROGRAM_LIMIT ints
+static void candidate_set_code(candidate *c, int *code, int len)
+{
+    int n = 0;
+    while (n < len && n + op_length(code[n]) <= PROGRAM_LIMIT) {
+        n += op_length(code[n]);
+    }
+    n = n < len ? n : len;
+    memcpy(c->code, code, n * sizeof(int));
+    c->prog.bytecode_len = n;
+}
+
+static void candidate_finish(candidate *c)
+{
+    program_link_labels(&c->prog);
+    program_specialize(&c->prog, c->spec_code);
+    c->deterministic = program_is_deterministic(&c->prog);
+}
+
+// One point crossover on instruction boundaries: the head of a followed by
+// the tail of b.
+static void candidate_crossover(unsigned int *seed, candidate *child, candidate *a, candidate *b)
+{
+    int offsets_a[PROGRAM_LIMIT + 1];
+    int offsets_b[PROGRAM_LIMIT + 1];
+    int na = instruction_offsets(a->code, a->prog.bytecode_len, offsets_a);
+    int nb = instruction_offsets(b->code, b->prog.bytecode_len, offsets_b);
+    int head = offsets_a[randrange(seed, 0, na)];
+    int k = randrange(seed, 0, nb);
+    int tail;
+
+    while (k < nb && head + b->prog.bytecode_len - offsets_b[k] > PROGRAM_LIMIT) k++;
+    tail = b->prog.bytecode_len - offsets_b[k];
+
+    memcpy(child->code, a->code, head * sizeof(int));
+    memcpy(&child->code[head], &b->code[offsets_b[k]], tail * sizeof(int));
+    child->prog.bytecode_len = head + tail;
+}
+
+static void evolve_job(void *ctx, int job)
+{
+    evolution *e = ctx;
+    int seat = job % PROGRAM_COUNT;
+    int o = (job / PROGRAM_COUNT) % e->opponent_count;
+    candidate *c = e->population[job / (PROGRAM_COUNT * e->opponent_count)];
+    int n = c->deterministic && e->opponent_deterministic[o] ? 1 : EVOLVE_MATCHES;
+    double score = 0;
+    int winner;
+    match m;
+
+    memset(&m, 0, sizeof(m));
+    m.fighter[seat] = &c->prog;
+    m.fighter[!seat] = e->opponent[o];
+    m.step_limit = STEP_LIMIT;
+    for (int i = 0; i < n; i++) {
+        m.seed = e->seed ^ ((e->generation * EVOLVE_MATCHES + i) * 2654435761u + job);
+        winner = fightvm_play_match(&m);
+        score += winner == seat ? 1 : winner == -1 ? 0.5 : 0;
+        // Break ties between equal records on remaining hp.
+        score += 0.01 * (m.hp[seat] - m.hp[!seat]) / MAX_HP;
+    }
+
+    e->job_score[job] = score;
+    e->job_matches[job] = n;
+}
+
+static int candidate_compare(const void *a, const void *b)
+{
+    double fa = (*(candidate **)a)->fitness;
+    double fb = (*(candidate **)b)->fitness;
+    return (fa < fb) - (fa > fb);
+}
+
+static candidate *evolve_pick(evolution *e)
+{
+    // Tournament of two among the survivors
+    int a = randrange(&e->seed, 0, EVOLVE_SURVIVORS - 1);
+    int b = randrange(&e->seed, 0, EVOLVE_SURVIVORS - 1);
+    return e->population[a < b ? a : b];
+}
+
+// Evaluates the whole population and returns the number of matches played.
+static int evolve_evaluate(evolution *e, worker_pool *pool)
+{
+    int per_candidate = e->opponent_count * PROGRAM_COUNT;
+    int matches = 0;
+    candidate *c;
+
+    pool_run(pool, evolve_job, e, EVOLVE_POPULATION * per_candidate);
+
+    for (int i = 0; i < EVOLVE_POPULATION; i++) {
+        c = e->population[i];
+        for (int j = i * per_candidate; j < (i + 1) * per_candidate; j++) {
+            c->score_sum += e->job_score[j];
+            c->score_count += e->job_matches[j];
+            matches += e->job_matches[j];
+        }
+        c->fitness = c->score_sum / c->score_count - EVOLVE_PARSIMONY * c->prog.bytecode_len;
+    }
+    qsort(e->population, EVOLVE_POPULATION, sizeof(candidate *), candidate_compare);
+    return matches;
+}
+
+static void evolve_next_generation(evolution *e)
+{
+    candidate *child;
+
+    for (int i = EVOLVE_SURVIVORS; i < EVOLVE_POPULATION; i++) {
+        candidate_free(&e->pool, e->population[i]);
+    }
+    for (int i = EVOLVE_SURVIVORS; i < EVOLVE_POPULATION; i++) {
+        child = candidate_alloc(&e->pool);
+        if (randrange(&e->seed, 0, 1)) {
+            candidate_crossover(&e->seed, child, evolve_pick(e), evolve_pick(e));
+        } else {
+            candidate *parent = evolve_pick(e);
+            candidate_set_code(child, parent->code, parent->prog.bytecode_len);
+        }
+        do {
+            candidate_mutate(&e->seed, child);
+        } while (randrange(&e->seed, 0, 1));
+        candidate_finish(child);
+        e->population[i] = child;
+    }
+    e->generation++;
+}
+
+static void evolve_write(evolution *e, const char *prefix)
+{
+    char path[PATH_MAX];
+    for (int i = 0; i < EVOLVE_WRITE; i++) {
+        snprintf(path, sizeof(path), "%s-%d.asm", prefix, i);
+        if (write_code(path, &e->population[i]->prog) != 0) {
+            fprintf(stderr, "Error writing %s\n", path);
+        }
+    }
+}
+
+// fightvm-evolve <generations> <out_prefix> [opponent.asm...]
+//
+// argv[0] is the command, so `fightvm evolve ...` passes its arguments on
+// from "evolve".
+int fightvm_evolve_main(int argc, char *argv[])
+{
+    static const char *default_opponents[] = { "ninja.asm", "viking.asm" };
+    evolution *e = &evolve_state;
+    worker_pool pool;
+    const char **opponent_paths = default_opponents;
+    int generations;
+    const char *prefix;
+    double start, elapsed;
+    int matches;
+    candidate *c;
+
+    if (argc < 3) return 0;
+    generations = strtol(argv[1], NULL, 0);
+    prefix = argv[2];
+
+    e->opponent_count = 2;
+    if (argc > 3) {
+        opponent_paths = (const char **)&argv[3];
+        e->opponent_count = CLAMP(argc - 3, 1, EVOLVE_OPPONENT_LIMIT);
+    }
+    for (int i = 0; i < e->opponent_count; i++) {
+        if ((int)read_code(opponent_paths[i], &evolve_opponent[i]) <= 0) {
+            fprintf(stderr, "Error reading %s\n", opponent_paths[i]);
+            return 1;
+        }
+        if (parse_code(&evolve_opponent[i]) != 0) {
+            fprintf(stderr, "Error parsing %s\n", opponent_paths[i]);
+            return 100;
+        }
+        if (evolve_opponent[i].bytecode_len > PROGRAM_LIMIT) {
+            fprintf(stderr, "%s is longer than %d ints, too long to evolve from\n",
+                    opponent_paths[i], PROGRAM_LIMIT);
+            return 1;
+        }
+        e->opponent[i] = &evolve_opponent[i];
+        e->opponent_deterministic[i] = program_is_deterministic(&evolve_opponent[i]);
+    }
+
+    // Start from the opponents themselves and mutations of them.
+    e->seed = time(NULL);
+    candidate_pool_init(&e->pool);
+    for (int i = 0; i < EVOLVE_POPULATION; i++) {
+        program *parent = e->opponent[i % e->opponent_count];
+        c = candidate_alloc(&e->pool);
+        candidate_set_code(c, parent->bytecode, parent->bytecode_len);
+        if (i >= e->opponent_count) {
+            candidate_mutate(&e->seed, c);
+        }
+        candidate_finish(c);
+        e->population[i] = c;
+    }
+
+    pool_start(&pool, pool_thread_count());
+    for (int g = 0; g < generations; g++) {
+        start = now_seconds();
+        matches = evolve_evaluate(e, &pool);
+        elapsed = now_seconds() - start;
+
+        c = e->population[0];
+        printf("generation %d: best %.3f (%zu ints), %d matches, %.0f matches/s\n",
+                e->generation, c->fitness, c->prog.bytecode_len, matches,
+                matches / elapsed);
+
+        if (g == generations - 1 || (g + 1) % EVOLVE_WRITE_INTERVAL == 0) {
+            evolve_write(e, prefix);
+        }
+        if (g < generations - 1) {
+            evolve_next_generation(e);
+        }
+    }
+    pool_stop(&pool);
+    return 0;
+}
+
+// fightvm serve protocol
+//
+// Every message is a serve_header followed by header.length bytes. All
+// integers are in host byte order, so workers reached over TCP must share
+// the coordinator's byte order.
+//
+// SERVE_LOAD    payload is assembly source. Answered by SERVE_LOADED with the
+//               64 bit hash the program is known by from then on, or by
+//               SERVE_ERROR if it does not assemble.
+// SERVE_MATCH   payload is an array of serve_pair. One SERVE_RESULT is sent
+//               for every pair as soon as it is finished, in any order,
+//               followed by SERVE_DONE once the whole batch is.
+// SERVE_UNLOAD  payload is a hash this connection loaded. Answered by
+//               SERVE_UNLOADED, or by SERVE_ERROR if it did not load it.
+//
+// While a batch is being played, SERVE_PROGRESS with no payload is sent
+// every SERVE_KEEPALIVE_SECONDS, so a client can tell a busy server from
+// a dead one even when a single pair takes minutes.
+//
+// At most SERVE_PROGRAM_LIMIT programs are resident at once; past that
+// SERVE_LOAD fails. A program stays resident while any connection has it
+// loaded, and a connection's loads are undone when it closes, so programs
+// of departed clients do not use up the table. Programs named on the
+// command line stay for the life of the server.
+//
+// Connections share one set of threads. Pairs from the batches of all
+// connections are handed out in turn, so a short batch is not held up
+// behind a long one, but it can still wait for the pairs that are already
+// being played to finish.
+typedef enum {
+    SERVE_LOAD = 1,
+    SERVE_LOADED,
+    SERVE_MATCH,
+    SERVE_RESULT,
+    SERVE_DONE,
+    SERVE_ERROR,
+    SERVE_UNLOAD,
+    SERVE_UNLOADED,
+    SERVE_PROGRESS,
+} serve_message_enum;
+
+typedef enum {
+    SERVE_OK = 0,
+    SERVE_UNKNOWN_PROGRAM,
+    // count does not fit the match counter
+    SERVE_BAD_COUNT,
+} serve_status_enum;
+
+typedef enum {
+    SERVE_PROGRAM_LIMIT = 1024,
+    SERVE_TABLE_SIZE = 2048,
+    SERVE_PAYLOAD_LIMIT = 1 << 17,
+    SERVE_BACKLOG = 64,
+    SERVE_KEEPALIVE_SECONDS = 5,
+} serve_limits_enum;
+
+typedef struct serve_header {
+    uint32_t type;
+    uint32_t length;
+} serve_header;
+
+typedef struct serve_pair {
+    uint64_t program[PROGRAM_COUNT];
+    // 0 samples adaptively, see fightvm_sample_pair.
+    uint32_t count;
+    uint32_t seed;
+} serve_pair;
+
+typedef struct serve_result {
+    uint32_t index;
+    uint32_t status;
+    int32_t wins[PROGRAM_COUNT];
+    int32_t draws;
+    int32_t matches;
+    int32_t rounds;
+} serve_result;
+
+typedef struct served_program {
+    uint64_t hash;
+    // Loads not yet undone. At 0 the entry is a tombstone that keeps probe
+    // chains intact until the slot is reused.
+    int loads;
+    // Jobs playing the program right now, see program_table_acquire
+    int users;
+    program prog;
+} served_program;
+
+// The table is open addressed on the source hash. Loads are counted, and
+// a program is only freed once it is unloaded and no job holds it.
+typedef struct program_table {
+    pthread_rwlock_t lock;
+    served_program entry[SERVE_TABLE_SIZE];
+    int count;
+} program_table;
+
+typedef struct serve_connection {
+    int fd;
+    pthread_mutex_t write_lock;
+    int pair_count;
+    // Hashes loaded over this connection, undone when it closes
+    uint64_t loaded[SERVE_PROGRAM_LIMIT];
+    int loaded_count;
+    // Received messages are read in place, so keep pairs aligned
+    union {
+        serve_pair pair[SERVE_PAYLOAD_LIMIT / sizeof(serve_pair)];
+        char text[SERVE_PAYLOAD_LIMIT];
+    } payload;
+} serve_connection;
+
+static program_table served;
+static worker_pool serve_pool;
+
+uint64_t hash_code(const char *text, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+    // 0 marks an empty slot
+    return h ? h : 1;
+}
+
+// Finds the loaded entry for hash. Call with the lock held.
+static served_program *program_table_lookup(program_table *t, uint64_t hash)
+{
+    int i = hash % SERVE_TABLE_SIZE;
+    for (int n = 0; n < SERVE_TABLE_SIZE && t->entry[i].hash != 0; n++) {
+        if (t->entry[i].hash == hash && t->entry[i].loads > 0) return &t->entry[i];
+        i = (i + 1) % SERVE_TABLE_SIZE;
+    }
+    return NULL;
+}
+
+// Finds a slot for hash: a tombstone no job holds, or an empty slot. Call
+// with the write lock held, which keeps users from growing.
+static served_program *program_table_free_slot(program_table *t, uint64_t hash)
+{
+    served_program *e;
+    int i = hash % SERVE_TABLE_SIZE;
+    for (int n = 0; n < SERVE_TABLE_SIZE; n++) {
+        e = &t->entry[i];
+        if (e->hash == 0) return e;
+        if (e->loads == 0 && __atomic_load_n(&e->users, __ATOMIC_ACQUIRE) == 0) return e;
+        i = (i + 1) % SERVE_TABLE_SIZE;
+    }
+    return NULL;
+}
+
+// Finds a loaded program and keeps it from being freed until
+// program_table_release.
+served_program *program_table_acquire(program_table *t, uint64_t hash)
+{
+    served_program *e;
+    pthread_rwlock_rdlock(&t->lock);
+    e = program_table_lookup(t, hash);
+    if (e) __atomic_add_fetch(&e->users, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&t->lock);
+    return e;
+}
+
+void program_table_release(served_program *e)
+{
+    if (e) __atomic_sub_fetch(&e->users, 1, __ATOMIC_RELEASE);
+}
+
+// Assembles source text into a resident program. Loading the same source
+// again only counts another load of the program that is already there.
+int program_table_load(program_table *t, const char *name, const char *text, size_t len, uint64_t *hash)
+{
+    served_program *e;
+    program p;
+    int loaded;
+
+    memset(&p, 0, sizeof(p));
+    *hash = hash_code(text, len);
+    pthread_rwlock_wrlock(&t->lock);
+    if ((e = program_table_lookup(t, *hash))) e->loads++;
+    pthread_rwlock_unlock(&t->lock);
+    if (e) return 0;
+
+    p.name = name;
+    check((p.asmcode = malloc(len + 1)));
+    check((p.bytecode = malloc(sizeof(int) * (len + 1))));
+    memcpy(p.asmcode, text, len);
+    p.asmcode[len] = '\0';
+    p.asmcode_len = len + 1;
+    check(parse_code(&p) == 0);
+
+    pthread_rwlock_wrlock(&t->lock);
+    if ((e = program_table_lookup(t, *hash))) {
+        e->loads++;
+    } else if (t->count < SERVE_PROGRAM_LIMIT && (e = program_table_free_slot(t, *hash))) {
+        program_free(&e->prog);
+        e->prog = p;
+        e->hash = *hash;
+        e->loads = 1;
+        t->count++;
+        memset(&p, 0, sizeof(p));
+    }
+    loaded = e != NULL;
+    pthread_rwlock_unlock(&t->lock);
+    check(loaded);
+
+    program_free(&p);
+    return 0;
+
+error:
+    program_free(&p);
+    return -1;
+}
+
+// Undoes one load of hash.
+int program_table_unload(program_table *t, uint64_t hash)
+{
+    served_program *e;
+    pthread_rwlock_wrlock(&t->lock);
+    e = program_table_lookup(t, hash);
+    if (e && --e->loads == 0) {
+        t->count--;
+        if (__atomic_load_n(&e->users, __ATOMIC_ACQUIRE) == 0) {
+            program_free(&e->prog);
+        }
+    }
+    pthread_rwlock_unlock(&t->lock);
+    return e ? 0 : -1;
+}
+
+static int read_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t r;
+    while (n > 0) {
+        r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    ssize_t r;
+    while (n > 0) {
+        r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int serve_send(int fd, uint32_t type, const void *payload, uint32_t length)
+{
+    serve_header h = { .type = type, .length = length };
+    if (write_full(fd, &h, sizeof(h)) != 0) return -1;
+    if (length && write_full(fd, payload, length) != 0) return -1;
+    return 0;
+}
+
+static void serve_job(void *ctx, int job)
+{
+    serve_connection *conn = ctx;
+    serve_pair *pair = &conn->payload.pair[job];
+    serve_result result = { .index = job, .status = SERVE_OK };
+    sample_config cfg = {
+        .half_width = SAMPLE_HALF_WIDTH,
+        .max_matches = pair->count ? (int)pair->count : SAMPLE_MAX,
+        .seed = pair->seed,
+        .adaptive = pair->count == 0,
+        .step_limit = STEP_LIMIT,
+    };
+    sample_result r;
+    served_program *a = program_table_acquire(&served, pair->program[0]);
+    served_program *b = program_table_acquire(&served, pair->program[1]);
+
+    if (pair->count > INT_MAX) {
+        result.status = SERVE_BAD_COUNT;
+    } else if (a && b) {
+        fightvm_sample_pair(&a->prog, &b->prog, &cfg, &r);
+        result.wins[0] = r.wins[0];
+        result.wins[1] = r.wins[1];
+        result.draws = r.draws;
+        result.matches = r.matches;
+        result.rounds = r.rounds;
+    } else {
+        result.status = SERVE_UNKNOWN_PROGRAM;
+    }
+    program_table_release(a);
+    program_table_release(b);
+
+    pthread_mutex_lock(&conn->write_lock);
+    serve_send(conn->fd, SERVE_RESULT, &result, sizeof(result));
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void serve_keepalive(void *ctx)
+{
+    serve_connection *conn = ctx;
+    pthread_mutex_lock(&conn->write_lock);
+    serve_send(conn->fd, SERVE_PROGRESS, NULL, 0);
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void *serve_connection_thread(void *arg)
+{
+    serve_connection *conn = arg;
+    serve_header h;
+    uint64_t hash;
+    int i;
+
+    while (read_full(conn->fd, &h, sizeof(h)) == 0) {
+        if (h.length > SERVE_PAYLOAD_LIMIT) break;
+        if (read_full(conn->fd, conn->payload.text, h.length) != 0) break;
+
+        switch (h.type) {
+            case SERVE_LOAD:
+                if (conn->loaded_count < SERVE_PROGRAM_LIMIT
+                        && program_table_load(&served, "served", conn->payload.text, h.length, &hash) == 0) {
+                    conn->loaded[conn->loaded_count++] = hash;
+                    serve_send(conn->fd, SERVE_LOADED, &hash, sizeof(hash));
+                } else {
+                    serve_send(conn->fd, SERVE_ERROR, NULL, 0);
+                }
+                break;
+            case SERVE_UNLOAD:
+                i = 0;
+                if (h.length == sizeof(hash)) {
+                    memcpy(&hash, conn->payload.text, sizeof(hash));
+                    while (i < conn->loaded_count && conn->loaded[i] != hash) i++;
+                }
+                if (h.length == sizeof(hash) && i < conn->loaded_count) {
+                    conn->loaded[i] = conn->loaded[--conn->loaded_count];
+                    program_table_unload(&served, hash);
+                    serve_send(conn->fd, SERVE_UNLOADED, NULL, 0);
+                } else {
+                    serve_send(conn->fd, SERVE_ERROR, NULL, 0);
+                }
+                break;
+            case SERVE_MATCH:
+                conn->pair_count = h.length / sizeof(serve_pair);
+                pool_run_ticking(&serve_pool, serve_job, conn, conn->pair_count,
+                        serve_keepalive, SERVE_KEEPALIVE_SECONDS);
+                serve_send(conn->fd, SERVE_DONE, NULL, 0);
+                break;
+            default:
+                serve_send(conn->fd, SERVE_ERROR, NULL, 0);
+                break;
+        }
+    }
+
+    for (i = 0; i < conn->loaded_count; i++) {
+        program_table_unload(&served, conn->loaded[i]);
+    }
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+    return NULL;
+}
+
+// Addresses are either host:port for TCP or a path for a Unix socket.
+static int address_is_tcp(const char *address)
+{
+    return strchr(address, ':') != NULL && address[0] != '/' && address[0] != '.';
+}
+
+static struct addrinfo *address_resolve(const char *address, int passive)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *info = NULL;
+    char host[256];
+    const char *port = strrchr(address, ':');
+
+    if (port - address >= sizeof(host)) return NULL;
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &info) != 0) return NULL;
+    return info;
+}
+
+static void socket_set_nodelay(int fd)
+{
+    int one = 1;
+    // Fails harmlessly on Unix sockets
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Makes reads and writes on fd fail with EAGAIN after the given time
+static void socket_set_timeout(int fd, int seconds)
+{
+    struct timeval tv = { .tv_sec = seconds };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int socket_listen(const char *address)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct addrinfo *info = NULL;
+    int fd = -1;
+    int one = 1;
+
+    if (address_is_tcp(address)) {
+        check((info = address_resolve(address, 1)));
+        check((fd = socket(info->ai_family, SOCK_STREAM, 0)) != -1);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        check(bind(fd, info->ai_addr, info->ai_addrlen) == 0);
+        freeaddrinfo(info);
+        info = NULL;
+    } else {
+        check(strlen(address) < sizeof(addr.sun_path));
+        strcpy(addr.sun_path, address);
+        unlink(address);
+        check((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
+        check(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    }
+    check(listen(fd, SERVE_BACKLOG) == 0);
+    return fd;
+
+error:
+    if (info) freeaddrinfo(info);
+    if (fd != -1) close(fd);
+    return -1;
+}
+
+int socket_connect(const char *address)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct addrinfo *info = NULL;
+    int fd = -1;
+
+    if (address_is_tcp(address)) {
+        check((info = address_resolve(address, 0)));
+        check((fd = socket(info->ai_family, SOCK_STREAM, 0)) != -1);
+        check(connect(fd, info->ai_addr, info->ai_addrlen) == 0);
+        freeaddrinfo(info);
+        socket_set_nodelay(fd);
+    } else {
+        check(strlen(address) < sizeof(addr.sun_path));
+        strcpy(addr.sun_path, address);
+        check((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
+        check(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    }
+    return fd;
+
+error:
+    if (info) freeaddrinfo(info);
+    if (fd != -1) close(fd);
+    return -1;
+}
+
+// fightvm serve <address> [program.asm...]
+int fightvm_serve_main(int argc, char *argv[])
+{
+    serve_connection *conn;
+    program p;
+    uint64_t hash;
+    pthread_t thread;
+    int fd = -1;
+    int client;
+
+    if (argc < 3) return 0;
+    pthread_rwlock_init(&served.lock, NULL);
+
+    for (int i = 3; i < argc; i++) {
+        memset(&p, 0, sizeof(p));
+        check((int)read_code(argv[i], &p) > 0);
+        check(program_table_load(&served, p.name, p.asmcode, p.asmcode_len - 1, &hash) == 0);
+        printf("%016llx %s\n", (unsigned long long)hash, p.name);
+        program_free(&p);
+    }
+
+    check((fd = socket_listen(argv[2])) != -1);
+
+    pool_start(&serve_pool, pool_thread_count());
+    printf("Serving %d programs on %s\n", served.count, argv[2]);
+    fflush(stdout);
+
+    for (;;) {
+        client = accept(fd, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        conn = malloc(sizeof(*conn));
+        if (conn == NULL) {
+            close(client);
+            continue;
+        }
+        socket_set_nodelay(client);
+        conn->fd = client;
+        conn->loaded_count = 0;
+        pthread_mutex_init(&conn->write_lock, NULL);
+        if (pthread_create(&thread, NULL, serve_connection_thread, conn) != 0) {
+            close(client);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    pool_stop(&serve_pool);
+    close(fd);
+    return 0;
+
+error:
+    fprintf(stderr, "fightvm serve failed\n");
+    if (fd != -1) close(fd);
+    return 1;
+}
+
+#define TOURNAMENT_MAGIC 0x54564d46 // "FMVT"
+#define TOURNAMENT_VERSION 3
+#define TOURNAMENT_RATING 1500.0
+#define TOURNAMENT_K 16.0
+#define TOURNAMENT_SYNC_SECONDS 5.0
+
+typedef enum {
+    SHARD_PENDING = 0,
+    SHARD_RUNNING,
+    SHARD_DONE,
+} shard_state_enum;
+
+typedef enum {
+    SHARD_PAIRS = 64,
+    COORDINATE_WORKER_LIMIT = 64,
+    // A worker that sends nothing for this long is taken for dead. Busy
+    // workers send SERVE_PROGRESS every SERVE_KEEPALIVE_SECONDS.
+    COORDINATE_TIMEOUT_SECONDS = 30,
+    TOURNAMENT_NAME_LIMIT = 48,
+} coordinate_limits_enum;
+
+// Tournament state file layout:
+//
+//     tournament_header
+//     tournament_program[program_count]
+//     pair_record[pair_count]
+//     uint8_t shard_done[shard_count]
+//
+// The file is mapped shared and updated in place, so a league that is
+// killed keeps everything it finished and a rerun maps it straight back.
+// Folding a pair into the standings is journaled in the header: the two
+// standings it changes are saved and the pair marked in flight first, so
+// reopening rolls back and replays at most that one pair.
+typedef struct tournament_program {
+    uint64_t hash;
+    char name[TOURNAMENT_NAME_LIMIT];
+    int32_t wins;
+    int32_t losses;
+    int32_t draws;
+    int32_t reserved;
+    double rating;
+} tournament_program;
+
+typedef struct tournament_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t program_count;
+    uint32_t pair_count;
+    uint32_t count;
+    uint32_t seed;
+    uint32_t pairs_done;
+    // Pair being folded into the standings plus one, 0 when none
+    uint32_t in_flight;
+    uint64_t matches;
+
+    // The state in_flight changes, as it was before
+    uint64_t undo_matches;
+    uint32_t undo_pairs_done;
+    uint32_t reserved;
+    tournament_program undo[PROGRAM_COUNT];
+} tournament_header;
+
+typedef struct pair_record {
+    uint32_t done;
+    uint32_t seed;
+    int32_t wins[PROGRAM_COUNT];
+    int32_t draws;
+    int32_t matches;
+    int32_t rounds;
+    int32_t reserved;
+} pair_record;
+
+// A full round robin split into shards of SHARD_PAIRS pairings. Pairs are
+// numbered in (i, j), i < j order and played with seed + pair index, so a
+// pair gives the same result whichever worker plays it.
+typedef struct league {
+    program prog[SERVE_PROGRAM_LIMIT];
+    uint64_t hash[SERVE_PROGRAM_LIMIT];
+    int program_count;
+
+    int pair_count;
+    int (*pair)[PROGRAM_COUNT];
+    uint32_t count;
+    uint32_t seed;
+
+    int shard_count;
+    int *shard;
+    int shards_done;
+    int workers_alive;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    tournament_header *state;
+    tournament_program *standing;
+    pair_record *result;
+    uint8_t *shard_done;
+    size_t state_size;
+    double synced;
+    int fresh;
+} league;
+
+typedef struct league_worker {
+    league *l;
+    const char *address;
+    int first;
+    serve_pair batch[SHARD_PAIRS];
+    pair_record result[SHARD_PAIRS];
+} league_worker;
+
+static league the_league;
+static league_worker league_workers[COORDINATE_WORKER_LIMIT];
+static worker_pool league_pool;
+
+// Folds one finished pairing into the standings.
+static void league_apply_pair(league *l, int p)
+{
+    tournament_program *a = &l->standing[l->pair[p][0]];
+    tournament_program *b = &l->standing[l->pair[p][1]];
+    pair_record *r = &l->result[p];
+    double expected, score;
+
+    a->wins += r->wins[0];
+    a->losses += r->wins[1];
+    a->draws += r->draws;
+    b->wins += r->wins[1];
+    b->losses += r->wins[0];
+    b->draws += r->draws;
+
+    if (r->matches > 0) {
+        expected = 1 / (1 + pow(10, (b->rating - a->rating) / 400));
+        score = (r->wins[0] + 0.5 * r->draws) / r->matches;
+        a->rating += TOURNAMENT_K * (score - expected);
+        b->rating -= TOURNAMENT_K * (score - expected);
+    }
+
+    l->state->matches += r->matches;
+    l->state->pairs_done++;
+}
+
+// Undoes a fold that was cut short by rolling the header's journal back,
+// then folds the pair in again.
+static void league_recover(league *l)
+{
+    tournament_header *h = l->state;
+    int p = h->in_flight - 1;
+
+    if (h->in_flight == 0 || p >= l->pair_count) return;
+    l->standing[l->pair[p][0]] = h->undo[0];
+    l->standing[l->pair[p][1]] = h->undo[1];
+    h->matches = h->undo_matches;
+    h->pairs_done = h->undo_pairs_done;
+    league_apply_pair(l, p);
+    __atomic_store_n(&l->result[p].done, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->in_flight, 0, __ATOMIC_RELEASE);
+}
+
+// Maps the state file, creating it if it is new or l->fresh is set. An
+// existing file that belongs to a different league is left alone.
+static int league_map_state(league *l, const char *path)
+{
+    size_t programs_size = l->program_count * sizeof(tournament_program);
+    size_t results_size = l->pair_count * sizeof(pair_record);
+    size_t size = sizeof(tournament_header) + programs_size + results_size + l->shard_count;
+    tournament_header *h = MAP_FAILED;
+    const char *mismatch = NULL;
+    struct stat st;
+    int resumed;
+    int fd;
+
+    check((fd = open(path, O_RDWR | O_CREAT, 0644)) != -1);
+    check(fstat(fd, &st) == 0);
+    resumed = st.st_size != 0 && !l->fresh;
+    if (resumed && st.st_size != size) {
+        mismatch = "its size does not match these programs";
+        goto error;
+    }
+    if (!resumed) {
+        check(ftruncate(fd, 0) == 0);
+        check(ftruncate(fd, size) == 0);
+    }
+    check((h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED);
+    close(fd);
+    fd = -1;
+
+    l->state = h;
+    l->state_size = size;
+    l->standing = (tournament_program *)(h + 1);
+    l->result = (pair_record *)((char *)l->standing + programs_size);
+    l->shard_done = (uint8_t *)l->result + results_size;
+
+    if (resumed) {
+        if (h->magic != TOURNAMENT_MAGIC) {
+            mismatch = "it is not a tournament state file";
+        } else if (h->version != TOURNAMENT_VERSION) {
+            mismatch = "it was written by another version";
+        } else if (h->program_count != l->program_count || h->pair_count != l->pair_count) {
+            mismatch = "it has a different number of programs";
+        } else if (h->count != l->count) {
+            mismatch = "it was played with a different match count";
+        }
+        for (int i = 0; mismatch == NULL && i < l->program_count; i++) {
+            if (l->standing[i].hash != l->hash[i]) mismatch = "its programs differ";
+        }
+    }
+    if (mismatch) goto error;
+
+    if (!resumed) {
+        memset(h, 0, size);
+        *h = (tournament_header) {
+            .magic = TOURNAMENT_MAGIC,
+            .version = TOURNAMENT_VERSION,
+            .program_count = l->program_count,
+            .pair_count = l->pair_count,
+            .count = l->count,
+            .seed = l->seed,
+        };
+        for (int i = 0; i < l->program_count; i++) {
+            l->standing[i].hash = l->hash[i];
+            snprintf(l->standing[i].name, TOURNAMENT_NAME_LIMIT, "%s", l->prog[i].name);
+            l->standing[i].rating = TOURNAMENT_RATING;
+        }
+        check(msync(h, size, MS_SYNC) == 0);
+    }
+    l->seed = h->seed;
+    league_recover(l);
+
+    for (int s = 0; s < l->shard_count; s++) {
+        l->shard[s] = l->shard_done[s] ? SHARD_DONE : SHARD_PENDING;
+        l->shards_done += l->shard_done[s] != 0;
+    }
+    if (resumed) {
+        printf("Resuming from %s with %u of %u pairs done\n", path, h->pairs_done, h->pair_count);
+    }
+    l->synced = now_seconds();
+    return 0;
+
+error:
+    if (mismatch) {
+        fprintf(stderr, "Not using %s: %s. Pass --fresh to overwrite it.\n", path, mismatch);
+    }
+    if (fd != -1) close(fd);
+    if (h != MAP_FAILED) munmap(h, size);
+    l->state = NULL;
+    return -1;
+}
+
+// Stores one finished pairing and folds it into the standings, journaled
+// so that league_recover can finish the job if it is cut short.
+static void league_record_pair(league *l, int p, pair_record *r)
+{
+    tournament_header *h = l->state;
+    pair_record *out = &l->result[p];
+    pair_record record = *r;
+
+    if (out->done) return;
+    record.done = 0;
+    *out = record;
+
+    h->undo[0] = l->standing[l->pair[p][0]];
+    h->undo[1] = l->standing[l->pair[p][1]];
+    h->undo_matches = h->matches;
+    h->undo_pairs_done = h->pairs_done;
+    __atomic_store_n(&h->in_flight, p + 1, __ATOMIC_RELEASE);
+    // Keep the fold below from moving ahead of the journal
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    league_apply_pair(l, p);
+    __atomic_store_n(&out->done, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->in_flight, 0, __ATOMIC_RELEASE);
+}
+
+// Hands out the next pending shard, waiting while others are still running
+// in case their worker dies. Returns -1 when there is nothing left to do.
+static int league_take_shard(league *l)
+{
+    int s = -1;
+    pthread_mutex_lock(&l->lock);
+    while (l->shards_done < l->shard_count) {
+        for (int i = 0; i < l->shard_count; i++) {
+            if (l->shard[i] == SHARD_PENDING) {
+                s = i;
+                break;
+            }
+        }
+        if (s != -1) {
+            l->shard[s] = SHARD_RUNNING;
+            break;
+        }
+        pthread_cond_wait(&l->changed, &l->lock);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return s;
+}
+
+static void league_finish_shard(league *l, int s, pair_record *result)
+{
+    int first = s * SHARD_PAIRS;
+    int n = CLAMP(l->pair_count - first, 0, SHARD_PAIRS);
+
+    pthread_mutex_lock(&l->lock);
+    for (int i = 0; i < n; i++) {
+        league_record_pair(l, first + i, &result[i]);
+    }
+    if (now_seconds() - l->synced > TOURNAMENT_SYNC_SECONDS) {
+        if (msync(l->state, l->state_size, MS_SYNC) != 0) {
+            fprintf(stderr, "Error syncing tournament state\n");
+        }
+        l->synced = now_seconds();
+    }
+    __atomic_store_n(&l->shard_done[s], 1, __ATOMIC_RELEASE);
+    l->shard[s] = SHARD_DONE;
+    l->shards_done++;
+    printf("Shard %d done, %d of %d\n", s, l->shards_done, l->shard_count);
+    fflush(stdout);
+    pthread_cond_broadcast(&l->changed);
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void league_requeue_shard(league *l, int s)
+{
+    pthread_mutex_lock(&l->lock);
+    l->shard[s] = SHARD_PENDING;
+    pthread_cond_broadcast(&l->changed);
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void league_local_job(void *ctx, int job)
+{
+    league_worker *w = ctx;
+    league *l = w->l;
+    int p = w->first + job;
+    sample_config cfg = {
+        .half_width = SAMPLE_HALF_WIDTH,
+        .max_matches = l->count ? l->count : SAMPLE_MAX,
+        .seed = l->seed + p,
+        .adaptive = l->count == 0,
+        .step_limit = STEP_LIMIT,
+    };
+    sample_result r;
+
+    fightvm_sample_pair(&l->prog[l->pair[p][0]], &l->prog[l->pair[p][1]], &cfg, &r);
+    w->result[job] = (pair_record) {
+        .done = 1,
+        .seed = cfg.seed,
+        .wins = { r.wins[0], r.wins[1] },
+        .draws = r.draws,
+        .matches = r.matches,
+        .rounds = r.rounds,
+    };
+}
+
+// Sends one shard to a worker and collects its results.
+static int league_play_shard(league_worker *w, int fd, int s)
+{
+    league *l = w->l;
+    int first = s * SHARD_PAIRS;
+    int n = CLAMP(l->pair_count - first, 0, SHARD_PAIRS);
+    int received = 0;
+    serve_header h;
+    serve_result r;
+
+    if (fd == -1) {
+        w->first = first;
+        pool_run(&league_pool, league_local_job, w, n);
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        w->batch[i].program[0] = l->hash[l->pair[first + i][0]];
+        w->batch[i].program[1] = l->hash[l->pair[first + i][1]];
+        w->batch[i].count = l->count;
+        w->batch[i].seed = l->seed + first + i;
+    }
+    check(serve_send(fd, SERVE_MATCH, w->batch, n * sizeof(serve_pair)) == 0);
+
+    for (;;) {
+        check(read_full(fd, &h, sizeof(h)) == 0);
+        if (h.type == SERVE_DONE) break;
+        if (h.type == SERVE_PROGRESS && h.length == 0) continue;
+        check(h.type == SERVE_RESULT && h.length == sizeof(r));
+        check(read_full(fd, &r, sizeof(r)) == 0);
+        check(r.index < n && r.status == SERVE_OK);
+        w->result[r.index] = (pair_record) {
+            .done = 1,
+            .seed = w->batch[r.index].seed,
+            .wins = { r.wins[0], r.wins[1] },
+            .draws = r.draws,
+            .matches = r.matches,
+            .rounds = r.rounds,
+        };
+        received++;
+    }
+    check(received == n);
+    return 0;
+
+error:
+    return -1;
+}
+
+// Drives one worker. The address "local" plays shards on this machine's
+// own thread pool instead of a remote server.
+static void *league_worker_thread(void *arg)
+{
+    league_worker *w = arg;
+    league *l = w->l;
+    serve_header h;
+    uint64_t hash;
+    program *p;
+    int fd = -1;
+    int s = -1;
+
+    if (strcmp(w->address, "local") != 0) {
+        check((fd = socket_connect(w->address)) != -1);
+        socket_set_timeout(fd, COORDINATE_TIMEOUT_SECONDS);
+
+        // Make sure the worker has every program resident
+        for (int i = 0; i < l->program_count; i++) {
+            p = &l->prog[i];
+            check(serve_send(fd, SERVE_LOAD, p->asmcode, p->asmcode_len - 1) == 0);
+            check(read_full(fd, &h, sizeof(h)) == 0);
+            check(h.type == SERVE_LOADED && h.length == sizeof(hash));
+            check(read_full(fd, &hash, sizeof(hash)) == 0);
+            check(hash == l->hash[i]);
+        }
+    }
+
+    while ((s = league_take_shard(l)) != -1) {
+        check(league_play_shard(w, fd, s) == 0);
+        league_finish_shard(l, s, w->result);
+    }
+    if (fd != -1) close(fd);
+
+    pthread_mutex_lock(&l->lock);
+    l->workers_alive--;
+    pthread_cond_broadcast(&l->changed);
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+
+error:
+    fprintf(stderr, "Lost worker %s\n", w->address);
+    if (fd != -1) close(fd);
+    if (s != -1) league_requeue_shard(l, s);
+    pthread_mutex_lock(&l->lock);
+    l->workers_alive--;
+    pthread_cond_broadcast(&l->changed);
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+static void league_print(league *l)
+{
+    tournament_program *t;
+    int games;
+
+    printf("%" PRIu64 " matches over %u pairs\n", l->state->matches, l->state->pairs_done);
+    for (int i = 0; i < l->program_count; i++) {
+        t = &l->standing[i];
+        games = t->wins + t->losses + t->draws;
+        printf("%-24s won %d, lost %d, drew %d, scores %.3f, rating %.0f\n", t->name,
+                t->wins, t->losses, t->draws,
+                games ? (t->wins + 0.5 * t->draws) / games : 0.0, t->rating);
+    }
+}
+
+// fightvm coordinate [--fresh] <state> <count> <worker,worker,...> <program.asm...>
+int fightvm_coordinate_main(int argc, char *argv[])
+{
+    league *l = &the_league;
+    pthread_t thread[COORDINATE_WORKER_LIMIT];
+    char *addresses;
+    char *address;
+    char *save;
+    int worker_count = 0;
+    int n = 0;
+
+    if (argc > 2 && strcmp(argv[2], "--fresh") == 0) {
+        l->fresh = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 7) return 0;
+    l->count = strtoul(argv[3], NULL, 0);
+    l->seed = time(NULL);
+    l->program_count = argc - 5;
+    if (l->program_count > SERVE_PROGRAM_LIMIT) {
+        fprintf(stderr, "At most %d programs can play in one league\n", SERVE_PROGRAM_LIMIT);
+        return 1;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->changed, NULL);
+
+    for (int i = 0; i < l->program_count; i++) {
+        program *p = &l->prog[i];
+        check((int)read_code(argv[5 + i], p) > 0);
+        check(parse_code(p) == 0);
+        l->hash[i] = hash_code(p->asmcode, p->asmcode_len - 1);
+    }
+
+    l->pair_count = l->program_count * (l->program_count - 1) / 2;
+    l->shard_count = (l->pair_count + SHARD_PAIRS - 1) / SHARD_PAIRS;
+    check((l->pair = malloc(l->pair_count * sizeof(*l->pair))));
+    check((l->shard = malloc(l->shard_count * sizeof(int))));
+    for (int i = 0; i < l->program_count; i++) {
+        for (int j = i + 1; j < l->program_count; j++) {
+            l->pair[n][0] = i;
+            l->pair[n][1] = j;
+            n++;
+        }
+    }
+    check(league_map_state(l, argv[2]) == 0);
+
+    addresses = strdup(argv[4]);
+    for (address = strtok_r(addresses, ",", &save); address && worker_count < COORDINATE_WORKER_LIMIT;
+            address = strtok_r(NULL, ",", &save)) {
+        league_workers[worker_count].l = l;
+        league_workers[worker_count].address = address;
+        if (strcmp(address, "local") == 0 && league_pool.thread_count == 0) {
+            pool_start(&league_pool, pool_thread_count());
+        }
+        worker_count++;
+    }
+
+    l->workers_alive = worker_count;
+    for (int i = 0; i < worker_count; i++) {
+        pthread_create(&thread[i], NULL, league_worker_thread, &league_workers[i]);
+    }
+
+    // Wait until either everything is done or nobody is left to do it.
+    pthread_mutex_lock(&l->lock);
+    while (l->shards_done < l->shard_count && l->workers_alive > 0) {
+        pthread_cond_wait(&l->changed, &l->lock);
+    }
+    // Wake workers still waiting for a shard so they can exit
+    pthread_cond_broadcast(&l->changed);
+    pthread_mutex_unlock(&l->lock);
+
+    if (l->shards_done < l->shard_count) {
+        msync(l->state, l->state_size, MS_SYNC);
+        fprintf(stderr, "All workers lost with %d of %d shards done, rerun to resume\n",
+                l->shards_done, l->shard_count);
+        return 1;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    if (league_pool.thread_count) {
+        pool_stop(&league_pool);
+    }
+
+    league_print(l);
+    msync(l->state, l->state_size, MS_SYNC);
+    munmap(l->state, l->state_size);
+    free(addresses);
+    return 0;
+
+error:
+    fprintf(stderr, "fightvm coordinate failed\n");
+    return 1;
+}
+
+typedef struct watched_file {
+    const char *path;
+    const char *name;
+    int wd;
+} watched_file;
+
+static int watch_fd = -1;
+static watched_file watched[PROGRAM_COUNT];
+
+// Watches the directories holding the programs rather than the files, as
+// most editors save by writing a new file and renaming it over the old one.
+int watch_start(const char *paths[])
+{
+    char dir[PATH_MAX];
+    const char *slash;
+
+    check((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1);
+    for (int i = 0; i < PROGRAM_COUNT; i++) {
+        slash = strrchr(paths[i], '/');
+        if (slash) {
+            check(slash - paths[i] < sizeof(dir));
+            memcpy(dir, paths[i], slash - paths[i] + 1);
+            dir[slash - paths[i] + 1] = '\0';
+        } else {
+            strcpy(dir, ".");
+        }
+        watched[i].path = paths[i];
+        watched[i].name = basename(paths[i]);
+        check((watched[i].wd = inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)) != -1);
+    }
+    return 0;
+
+error:
+    if (watch_fd != -1) close(watch_fd);
+    watch_fd = -1;
+    return -1;
+}
+
+// Reassembles one program and swaps it in. On error the old code is kept.
+static int watch_reload(int i)
+{
+    double start = now_seconds();
+    program *p = &user_program[i];
+    program fresh;
+
+    memset(&fresh, 0, sizeof(fresh));
+    if ((int)read_code(watched[i].path, &fresh) <= 0 || parse_code(&fresh) != 0) {
+        fprintf(stderr, "Error reloading %s, keeping the old code\n", watched[i].path);
+        program_free(&fresh);
+        return 0;
+    }
+
+    program_free(p);
+    p->asmcode = fresh.asmcode;
+    p->asmcode_len = fresh.asmcode_len;
+    p->bytecode = fresh.bytecode;
+    p->bytecode_len = fresh.bytecode_len;
+    memcpy(p->labels, fresh.labels, sizeof(p->labels));
+    p->spec = fresh.spec;
+
+    printf("Reloaded %s in %.3f ms\n", p->name, (now_seconds() - start) * 1000);
+    return 1;
+}
+
+// Reloads any program whose file changed since the last call. Returns the
+// number of programs reloaded.
+int watch_poll()
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    int changed[PROGRAM_COUNT] = { 0 };
+    int reloaded = 0;
+    ssize_t len;
+
+    if (watch_fd == -1) return 0;
+    while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+            event = (struct inotify_event *)p;
+            for (int i = 0; i < PROGRAM_COUNT; i++) {
+                if (event->wd == watched[i].wd && event->len && strcmp(event->name, watched[i].name) == 0) {
+                    changed[i] = 1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < PROGRAM_COUNT; i++) {
+        if (changed[i]) {
+            reloaded += watch_reload(i);
+        }
+    }
+    return reloaded;
+}
+
+void fightvm_program_loop()
+{
+    match *m = &current_match;
+    int quit = 0;
+
+    m->fighter[0] = &user_program[0];
+    m->fighter[1] = &user_program[1];
+    m->verbose = 1;
+
+    while (!quit) {
+        fightvm_reset_match(m);
+
+        while (!(quit = done()) && m->hp[0] > 0 && m->hp[1] > 0) {
+            fightvm_play_round(m);
+
+            draw();
+            sync_frame();
+
+            puts("--------------------");
+
+            // Edited programs take over from the next round
+            watch_poll();
+        }
+
+        printf("%s has %d hitpoints left after %d rounds.\n", user_program[0].name, m->hp[0], m->rounds);
+        printf("%s has %d hitpoints left after %d rounds.\n", user_program[1].name, m->hp[1], m->rounds);
+
+        // When watching, an edit after the match is over starts a new one.
+        while (!quit && !(quit = done())) {
+            if (watch_poll() > 0) break;
+            SDL_Delay(100);
+        }
+    }
+
+}
+    
+// Opens the window with room for a grid of columns x rows matches.
+static void video_start(int columns, int rows)
+{
+    // sdl init
+    SDL_Init(SDL_INIT_EVERYTHING);
+
+    // no filtering
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
 
     // create window
-    SDL_Window *window = SDL_CreateWindow("pixels", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+    window = SDL_CreateWindow("pixels", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
             W * 6, H * 6, SDL_WINDOW_RESIZABLE);
 
     // create renderer
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
-
-    // create gpu texture
-    gpu_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, W, H);
-    SDL_RenderSetLogicalSize(renderer, W, H);
-    SDL_SetRenderTarget(renderer, gpu_texture);
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_RenderSetLogicalSize(renderer, W * columns, H * rows);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
+}
 
-    // create cpu texture
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-#define rmask 0xff000000
-#define gmask 0x00ff0000
-#define bmask 0x0000ff00
-#define amask 0x000000ff
-#else
-#define rmask 0x000000ff
-#define gmask 0x0000ff00
-#define bmask 0x00ff0000
-#define amask 0xff000000
-#endif
-    SDL_Surface *surface = SDL_CreateRGBSurface(0, W, H, 32, rmask, gmask, bmask, amask);
-    cpu_texture.surface = surface;
-    cpu_texture.w = surface->w;
-    cpu_texture.h = surface->h;
-    cpu_texture.pixels = (Uint32 *) surface->pixels;
-    SDL_SetSurfaceBlendMode(cpu_texture.surface, SDL_BLENDMODE_NONE);
+static void video_stop()
+{
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+}
+
+typedef struct grid_tally {
+    int wins[PROGRAM_COUNT];
+    int draws;
+    int matches;
+} grid_tally;
+
+static match grid_match[GRID_LIMIT];
+static grid_tally grid_score[GRID_LIMIT];
+// What the window shows, written by the jobs and read by the renderer
+static int grid_hp[GRID_LIMIT][PROGRAM_COUNT];
+static int grid_count;
+static unsigned int grid_seed;
+static int grid_quit;
+static worker_pool grid_pool;
+
+// Plays a slice of one match, publishes its hp, and starts a rematch once
+// it is over.
+static void grid_job(void *ctx, int job)
+{
+    match *m = &grid_match[job];
+    grid_tally *t = &grid_score[job];
+
+    for (int i = 0; i < GRID_ROUNDS_PER_JOB && !fightvm_match_over(m); i++) {
+        fightvm_play_round(m);
+    }
+    for (int j = 0; j < PROGRAM_COUNT; j++) {
+        __atomic_store_n(&grid_hp[job][j], m->hp[j], __ATOMIC_RELAXED);
+    }
+    if (fightvm_match_over(m)) {
+        if (m->hp[0] == m->hp[1]) {
+            t->draws++;
+        } else {
+            t->wins[m->hp[1] > m->hp[0]]++;
+        }
+        t->matches++;
+        m->seed = match_seed(grid_seed, t->matches * grid_count + job);
+        fightvm_reset_match(m);
+    }
+}
+
+// Keeps every match going on the pool, independent of the frame rate.
+static void *grid_simulate(void *arg)
+{
+    while (!__atomic_load_n(&grid_quit, __ATOMIC_ACQUIRE)) {
+        pool_run(&grid_pool, grid_job, NULL, grid_count);
+    }
+    return NULL;
+}
+
+// fightvm grid <program.asm...>
+//
+// Plays every pairing at once, over and over, on the worker pool, and
+// shows the hp of all of them in one window. Drawing only samples the
+// matches, so it never holds up the simulation. The tally of every
+// pairing is printed when the window is closed.
+int fightvm_grid_main(int argc, char *argv[])
+{
+    static program grid_program[SERVE_PROGRAM_LIMIT];
+    static int frame_hp[GRID_LIMIT][PROGRAM_COUNT];
+    int program_count = argc - 2;
+    int columns = 1;
+    pthread_t simulator;
+    grid_tally *t;
+    match *m;
+    int n = 0;
+
+    if (program_count < 2) return 0;
+    if (program_count * (program_count - 1) / 2 > GRID_LIMIT) {
+        fprintf(stderr, "At most %d pairings fit in the grid\n", GRID_LIMIT);
+        return 1;
+    }
+    for (int i = 0; i < program_count; i++) {
+        if ((int)read_code(argv[2 + i], &grid_program[i]) <= 0 || parse_code(&grid_program[i]) != 0) {
+            fprintf(stderr, "Error loading %s\n", argv[2 + i]);
+            return 100;
+        }
+    }
+
+    grid_seed = time(NULL);
+    for (int i = 0; i < program_count; i++) {
+        for (int j = i + 1; j < program_count; j++) {
+            m = &grid_match[n];
+            m->fighter[0] = &grid_program[i];
+            m->fighter[1] = &grid_program[j];
+            m->seed = match_seed(grid_seed, n);
+            fightvm_reset_match(m);
+            grid_hp[n][0] = m->hp[0];
+            grid_hp[n][1] = m->hp[1];
+            n++;
+        }
+    }
+    grid_count = n;
+    while (columns * columns < n) columns++;
+
+    video_start(columns, (n + columns - 1) / columns);
+    pool_start(&grid_pool, pool_thread_count());
+    pthread_create(&simulator, NULL, grid_simulate, NULL);
+
+    while (!done()) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < PROGRAM_COUNT; j++) {
+                frame_hp[i][j] = __atomic_load_n(&grid_hp[i][j], __ATOMIC_RELAXED);
+            }
+        }
+        draw_matches(frame_hp, n, columns);
+        sync_frame();
+    }
+
+    __atomic_store_n(&grid_quit, 1, __ATOMIC_RELEASE);
+    pthread_join(simulator, NULL);
+    pool_stop(&grid_pool);
+    video_stop();
+
+    for (int i = 0; i < n; i++) {
+        m = &grid_match[i];
+        t = &grid_score[i];
+        printf("%s won %d, %s won %d, %d draws over %d matches.\n", m->fighter[0]->name,
+                t->wins[0], m->fighter[1]->name, t->wins[1], t->draws, t->matches);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (strcmp(basename(argv[0]), "fightvm-evolve") == 0) {
+        return fightvm_evolve_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "sample") == 0) {
+        return fightvm_sample_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "evolve") == 0) {
+        return fightvm_evolve_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return fightvm_serve_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "coordinate") == 0) {
+        return fightvm_coordinate_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "grid") == 0) {
+        return fightvm_grid_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "analyze") == 0) {
+        return fightvm_analyze_main(argc, argv);
+    }
+
+    int watching = argc == 4 && strcmp(argv[1], "watch") == 0;
+    if (watching) {
+        argc--;
+        argv++;
+    }
+
+    if (argc != 3) return 0;
+    const char *code1_path_arg = argv[1];
+    const char *code2_path_arg = argv[2];
+
+    video_start(1, 1);
 
     read_code(code1_path_arg, &user_program[0]);
-    parse_code(&user_program[0]);
+    if (parse_code(&user_program[0]) != 0) return 100;
 
     read_code(code2_path_arg, &user_program[1]);
-    parse_code(&user_program[1]);
+    if (parse_code(&user_program[1]) != 0) return 100;
+
+    if (watching && watch_start((const char **)&argv[1]) != 0) {
+        fprintf(stderr, "Error watching %s and %s\n", code1_path_arg, code2_path_arg);
+        return 1;
+    }
 
     fightvm_init();
     #ifdef __EMSCRIPTEN__
@@ -821,8 +3691,7 @@ int main(int argc, char *argv[])
     #endif
 
     // Cleanup
-    SDL_DestroyTexture(gpu_texture);
-    SDL_FreeSurface(surface);
+    video_stop();
     return 0;
 }
 